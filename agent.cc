@@ -0,0 +1,656 @@
+/*
+ * This file is part of hbackup.
+ * Copyright (C) 2009 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+
+// nhbackup --agent, a helper that runs on the repository host in place of
+// sftp-server (see --remote-agent).  It speaks SFTP v3, so SftpFilesystem
+// needs nothing special to talk to it, plus extensions that save round trips
+// on the operations a backup does most:
+//
+//  - AGENT_EXISTS tests the existence of a whole batch of paths at once
+//  - AGENT_PUT streams a file into place, creating directories as needed and
+//    renaming it atomically at the end, without waiting for anything
+//  - check-file-name and check-file-handle hash files where they live
+//
+// Only what nhbackup uses is implemented.  The test suite's stand-in for
+// sftp-server (sftpstub.cc) is the same code offering fewer extensions.
+
+#include "nhbackup.h"
+#include "sftp.h"
+#include <csignal>
+#include <stdexcept>
+#include <poll.h>
+
+// An open file or directory
+struct Handle {
+  int fd;                               // file, or -1
+  DIR *dir;                             // directory, or null
+  string path;
+};
+
+static map<string, Handle> handles;
+static unsigned long nexthandle;
+static set<string> offered;             // extensions advertised
+static bool extended_attrs;             // add extended attributes to ATTRS
+static string output;                   // replies not yet written...
+static size_t written;                  // ...apart from this many bytes
+static map<string, int> uploads;        // AGENT_PUT target -> temporary file
+
+// Replies --------------------------------------------------------------------
+
+static void reply(const string &payload) {
+  pack_uint32(output, payload.size());
+  output.append(payload);
+}
+
+static void reply_status(uint32_t id, uint32_t status, const char *message) {
+  string r;
+  pack_uint8(r, SSH_FXP_STATUS);
+  pack_uint32(r, id);
+  pack_uint32(r, status);
+  pack_string(r, message);
+  pack_string(r, "");                   // language tag
+  reply(r);
+}
+
+static void reply_errno(uint32_t id, int errno_value) {
+  uint32_t status;
+  switch(errno_value) {
+  case ENOENT: status = SSH_FX_NO_SUCH_FILE; break;
+  case EACCES:
+  case EPERM: status = SSH_FX_PERMISSION_DENIED; break;
+  default: status = SSH_FX_FAILURE; break;
+  }
+  reply_status(id, status, strerror(errno_value));
+}
+
+static void reply_unsupported(uint32_t id) {
+  reply_status(id, SSH_FX_OP_UNSUPPORTED, "unsupported");
+}
+
+static void reply_handle(uint32_t id, const Handle &h) {
+  char buffer[32];
+  snprintf(buffer, sizeof buffer, "%lu", ++nexthandle);
+  handles[buffer] = h;
+  string r;
+  pack_uint8(r, SSH_FXP_HANDLE);
+  pack_uint32(r, id);
+  pack_string(r, buffer);
+  reply(r);
+}
+
+static void pack_attrs(string &s, const struct stat &sb) {
+  pack_uint32(s, (SSH_FILEXFER_ATTR_SIZE|SSH_FILEXFER_ATTR_UIDGID
+                  |SSH_FILEXFER_ATTR_PERMISSIONS|SSH_FILEXFER_ATTR_ACMODTIME
+                  |(extended_attrs ? SSH_FILEXFER_ATTR_EXTENDED : 0)));
+  pack_uint64(s, sb.st_size);
+  pack_uint32(s, sb.st_uid);
+  pack_uint32(s, sb.st_gid);
+  pack_uint32(s, sb.st_mode);
+  pack_uint32(s, sb.st_atime);
+  pack_uint32(s, sb.st_mtime);
+  if(extended_attrs) {
+    // Meaningless, but clients must skip over them
+    pack_uint32(s, 2);
+    pack_string(s, "stub1@hbackup.greenend.org.uk");
+    pack_string(s, "one");
+    pack_string(s, "stub2@hbackup.greenend.org.uk");
+    pack_string(s, "two");
+  }
+}
+
+static void reply_attrs(uint32_t id, const struct stat &sb) {
+  string r;
+  pack_uint8(r, SSH_FXP_ATTRS);
+  pack_uint32(r, id);
+  pack_attrs(r, sb);
+  reply(r);
+}
+
+// Requests -------------------------------------------------------------------
+
+// Return the handle named by the next field of REQ, or a null pointer
+static Handle *gethandle(const string &req, size_t &index) {
+  const map<string, Handle>::iterator it
+    = handles.find(unpack_string(req, index));
+  return it != handles.end() ? &it->second : 0;
+}
+
+// Hash part of an open file, for check-file-name and check-file-handle
+static void checkfile(uint32_t id, int fd, const string &req, size_t &index) {
+  const string algorithms = unpack_string(req, index);
+  uint64_t offset = unpack_uint64(req, index);
+  uint64_t length = unpack_uint64(req, index);
+  const uint32_t blocksize = unpack_uint32(req, index);
+  // Only whole-range SHA-1 hashes are supported
+  if(blocksize != 0
+     || ("," + algorithms + ",").find("," HASH_NAME ",") == string::npos) {
+    reply_unsupported(id);
+    return;
+  }
+  Hash hash;
+  char buffer[65536];
+  for(;;) {
+    size_t chunk = sizeof buffer;
+    if(length && length < chunk)
+      chunk = length;
+    const ssize_t n = pread(fd, buffer, chunk, offset);
+    if(n < 0) {
+      reply_errno(id, errno);
+      return;
+    }
+    if(n == 0)
+      break;
+    hash.write(buffer, n);
+    offset += n;
+    if(length && !(length -= n))
+      break;
+  }
+  string r;
+  pack_uint8(r, SSH_FXP_EXTENDED_REPLY);
+  pack_uint32(r, id);
+  pack_string(r, "check-file");
+  pack_string(r, HASH_NAME);
+  r.append((const char *)hash.value(), HASH_SIZE);
+  reply(r);
+}
+
+// Agent Extensions -----------------------------------------------------------
+
+// AGENT_EXISTS: a count and that many paths; the reply is a string with a byte
+// for each path, 1 if it exists and 0 if not
+static void batch_exists(uint32_t id, const string &req, size_t &index) {
+  const uint32_t count = unpack_uint32(req, index);
+  string found;
+  struct stat sb;
+
+  found.reserve(count);
+  for(uint32_t n = 0; n < count; ++n)
+    found += (char)(stat(unpack_string(req, index).c_str(), &sb) == 0);
+  string r;
+  pack_uint8(r, SSH_FXP_EXTENDED_REPLY);
+  pack_uint32(r, id);
+  pack_string(r, found);
+  reply(r);
+}
+
+// Forget the upload to PATH, deleting what has been written so far
+static void abandon(map<string, int>::iterator it) {
+  ::close(it->second);
+  unlink((it->first + ".tmp").c_str());
+  uploads.erase(it);
+}
+
+// Create the parent directories of PATH
+static void makeparents(const string &path) {
+  for(string::size_type n = 1; n < path.size(); ++n)
+    if(path[n] == '/')
+      ::mkdir(string(path, 0, n).c_str(), 0777);
+}
+
+// AGENT_PUT: a path, an offset, flags and some data.  The data is written to
+// PATH.tmp, which is created (along with any missing directories) by the
+// chunk at offset 0.  After the chunk flagged AGENT_PUT_LAST it is renamed to
+// PATH; AGENT_PUT_ABORT deletes it instead.  Every chunk gets a status reply
+// but the client need not wait for them.
+static void put(uint32_t id, const string &req, size_t &index) {
+  const string path = unpack_string(req, index);
+  const uint64_t offset = unpack_uint64(req, index);
+  const uint32_t flags = unpack_uint32(req, index);
+  const uint32_t len = unpack_uint32(req, index);
+  const char *data = req.data() + index;
+  if(index + len > req.size())
+    throw out_of_range(AGENT_PUT);
+  const string tmpname = path + ".tmp";
+  map<string, int>::iterator it = uploads.find(path);
+
+  if(flags & AGENT_PUT_ABORT) {
+    if(it != uploads.end())
+      abandon(it);
+    reply_status(id, SSH_FX_OK, "");
+    return;
+  }
+  if(offset == 0) {
+    if(it != uploads.end())
+      abandon(it);                      // start again
+    int fd = ::open(tmpname.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if(fd < 0 && errno == ENOENT) {
+      makeparents(tmpname);
+      fd = ::open(tmpname.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    }
+    if(fd < 0) {
+      reply_errno(id, errno);
+      return;
+    }
+    it = uploads.insert(make_pair(path, fd)).first;
+  } else if(it == uploads.end()) {
+    // An earlier chunk failed, and has already been reported
+    reply_status(id, SSH_FX_FAILURE, "no upload in progress");
+    return;
+  }
+  size_t written = 0;
+  while(written < len) {
+    const ssize_t n = pwrite(it->second, data + written, len - written,
+                             offset + written);
+    if(n < 0) {
+      const int save_errno = errno;
+      abandon(it);
+      reply_errno(id, save_errno);
+      return;
+    }
+    written += n;
+  }
+  if(flags & AGENT_PUT_LAST) {
+    const int fd = it->second;
+    uploads.erase(it);
+    if(::close(fd) < 0 || ::rename(tmpname.c_str(), path.c_str()) < 0) {
+      const int save_errno = errno;
+      unlink(tmpname.c_str());
+      reply_errno(id, save_errno);
+      return;
+    }
+  }
+  reply_status(id, SSH_FX_OK, "");
+}
+
+// Dispatch -------------------------------------------------------------------
+
+static void extended(uint32_t id, const string &req, size_t &index) {
+  const string name = unpack_string(req, index);
+  if(offered.find(name) == offered.end()) {
+    reply_unsupported(id);
+  } else if(name == POSIX_RENAME) {
+    const string oldpath = unpack_string(req, index);
+    const string newpath = unpack_string(req, index);
+    if(::rename(oldpath.c_str(), newpath.c_str()) < 0)
+      reply_errno(id, errno);
+    else
+      reply_status(id, SSH_FX_OK, "");
+  } else if(name == OPENSSH_LIMITS) {
+    string r;
+    pack_uint8(r, SSH_FXP_EXTENDED_REPLY);
+    pack_uint32(r, id);
+    pack_uint64(r, SFTP_MAX_REQUEST + 1024); // packet length
+    pack_uint64(r, SFTP_MAX_REQUEST);   // read length
+    pack_uint64(r, SFTP_MAX_REQUEST);   // write length
+    pack_uint64(r, 0);                  // open handles
+    reply(r);
+  } else if(name == "check-file-name") {
+    const string path = unpack_string(req, index);
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+      reply_errno(id, errno);
+      return;
+    }
+    checkfile(id, fd, req, index);
+    ::close(fd);
+  } else if(name == "check-file-handle") {
+    const Handle *const h = gethandle(req, index);
+    if(!h || h->fd < 0)
+      reply_status(id, SSH_FX_FAILURE, "invalid handle");
+    else
+      checkfile(id, h->fd, req, index);
+  } else if(name == AGENT_EXISTS) {
+    batch_exists(id, req, index);
+  } else if(name == AGENT_PUT) {
+    put(id, req, index);
+  } else
+    reply_unsupported(id);
+}
+
+static void listdir(uint32_t id, Handle *h) {
+  string entries;
+  uint32_t count = 0;
+  struct dirent *de;
+  struct stat sb;
+
+  while(count < 100 && (de = ::readdir(h->dir))) {
+    if(lstat((h->path + "/" + de->d_name).c_str(), &sb) < 0)
+      continue;                         // vanished
+    pack_string(entries, de->d_name);
+    pack_string(entries, de->d_name);   // long name
+    pack_attrs(entries, sb);
+    ++count;
+  }
+  if(!count) {
+    reply_status(id, SSH_FX_EOF, "end of directory");
+    return;
+  }
+  string r;
+  pack_uint8(r, SSH_FXP_NAME);
+  pack_uint32(r, id);
+  pack_uint32(r, count);
+  r.append(entries);
+  reply(r);
+}
+
+static void process(const string &req) {
+  size_t index = 0;
+  const uint8_t type = unpack_uint8(req, index);
+  if(type == SSH_FXP_INIT) {
+    string r;
+    pack_uint8(r, SSH_FXP_VERSION);
+    pack_uint32(r, 3);
+    for(set<string>::const_iterator it = offered.begin();
+        it != offered.end();
+        ++it) {
+      pack_string(r, *it);
+      pack_string(r, (*it == "check-file-name"
+                      || *it == "check-file-handle") ? HASH_NAME : "1");
+    }
+    reply(r);
+    return;
+  }
+  const uint32_t id = unpack_uint32(req, index);
+  struct stat sb;
+  Handle *h;
+  switch(type) {
+  case SSH_FXP_OPEN: {
+    const string path = unpack_string(req, index);
+    const uint32_t pflags = unpack_uint32(req, index);
+    Attributes attrs;
+    unpack_attrs(req, index, attrs);
+    int flags;
+    if((pflags & SSH_FXF_READ) && (pflags & SSH_FXF_WRITE)) flags = O_RDWR;
+    else if(pflags & SSH_FXF_WRITE) flags = O_WRONLY;
+    else flags = O_RDONLY;
+    if(pflags & SSH_FXF_APPEND) flags |= O_APPEND;
+    if(pflags & SSH_FXF_CREAT) flags |= O_CREAT;
+    if(pflags & SSH_FXF_TRUNC) flags |= O_TRUNC;
+    if(pflags & SSH_FXF_EXCL) flags |= O_EXCL;
+    Handle nh;
+    nh.fd = ::open(path.c_str(), flags,
+                   (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS
+                    ? attrs.permissions & 07777 : 0666));
+    nh.dir = 0;
+    nh.path = path;
+    if(nh.fd < 0)
+      reply_errno(id, errno);
+    else
+      reply_handle(id, nh);
+    break;
+  }
+  case SSH_FXP_OPENDIR: {
+    Handle nh;
+    nh.path = unpack_string(req, index);
+    nh.fd = -1;
+    if(!(nh.dir = opendir(nh.path.c_str())))
+      reply_errno(id, errno);
+    else
+      reply_handle(id, nh);
+    break;
+  }
+  case SSH_FXP_CLOSE: {
+    const string name = unpack_string(req, index);
+    const map<string, Handle>::iterator it = handles.find(name);
+    if(it == handles.end()) {
+      reply_status(id, SSH_FX_FAILURE, "invalid handle");
+      break;
+    }
+    const int rc = (it->second.dir ? closedir(it->second.dir)
+                    : ::close(it->second.fd));
+    handles.erase(it);
+    if(rc < 0)
+      reply_errno(id, errno);
+    else
+      reply_status(id, SSH_FX_OK, "");
+    break;
+  }
+  case SSH_FXP_READ: {
+    if(!(h = gethandle(req, index)) || h->fd < 0) {
+      reply_status(id, SSH_FX_FAILURE, "invalid handle");
+      break;
+    }
+    const uint64_t offset = unpack_uint64(req, index);
+    uint32_t len = unpack_uint32(req, index);
+    if(len > SFTP_MAX_REQUEST)
+      len = SFTP_MAX_REQUEST;
+    string r;
+    pack_uint8(r, SSH_FXP_DATA);
+    pack_uint32(r, id);
+    pack_uint32(r, 0);                  // length, filled in below
+    r.resize(9 + len);
+    const ssize_t n = pread(h->fd, &r[9], len, offset);
+    if(n < 0)
+      reply_errno(id, errno);
+    else if(n == 0)
+      reply_status(id, SSH_FX_EOF, "end of file");
+    else {
+      r.resize(9 + n);
+      string slen;
+      pack_uint32(slen, n);
+      r.replace(5, 4, slen);
+      reply(r);
+    }
+    break;
+  }
+  case SSH_FXP_WRITE: {
+    if(!(h = gethandle(req, index)) || h->fd < 0) {
+      reply_status(id, SSH_FX_FAILURE, "invalid handle");
+      break;
+    }
+    uint64_t offset = unpack_uint64(req, index);
+    const uint32_t len = unpack_uint32(req, index);
+    const char *data = req.data() + index;
+    if(index + len > req.size())
+      throw out_of_range("SSH_FXP_WRITE");
+    size_t written = 0;
+    while(written < len) {
+      const ssize_t n = pwrite(h->fd, data + written, len - written,
+                               offset + written);
+      if(n < 0)
+        break;
+      written += n;
+    }
+    if(written < len)
+      reply_errno(id, errno);
+    else
+      reply_status(id, SSH_FX_OK, "");
+    break;
+  }
+  case SSH_FXP_LSTAT:
+  case SSH_FXP_STAT: {
+    const string path = unpack_string(req, index);
+    const int rc = (type == SSH_FXP_LSTAT ? lstat(path.c_str(), &sb)
+                    : stat(path.c_str(), &sb));
+    if(rc < 0)
+      reply_errno(id, errno);
+    else
+      reply_attrs(id, sb);
+    break;
+  }
+  case SSH_FXP_FSTAT:
+    if(!(h = gethandle(req, index)) || h->fd < 0)
+      reply_status(id, SSH_FX_FAILURE, "invalid handle");
+    else if(fstat(h->fd, &sb) < 0)
+      reply_errno(id, errno);
+    else
+      reply_attrs(id, sb);
+    break;
+  case SSH_FXP_READDIR:
+    if(!(h = gethandle(req, index)) || !h->dir)
+      reply_status(id, SSH_FX_FAILURE, "invalid handle");
+    else
+      listdir(id, h);
+    break;
+  case SSH_FXP_REMOVE:
+    if(unlink(unpack_string(req, index).c_str()) < 0)
+      reply_errno(id, errno);
+    else
+      reply_status(id, SSH_FX_OK, "");
+    break;
+  case SSH_FXP_MKDIR: {
+    const string path = unpack_string(req, index);
+    Attributes attrs;
+    unpack_attrs(req, index, attrs);
+    if(::mkdir(path.c_str(), (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS
+                              ? attrs.permissions & 07777 : 0777)) < 0)
+      reply_errno(id, errno);
+    else
+      reply_status(id, SSH_FX_OK, "");
+    break;
+  }
+  case SSH_FXP_RMDIR:
+    if(::rmdir(unpack_string(req, index).c_str()) < 0)
+      reply_errno(id, errno);
+    else
+      reply_status(id, SSH_FX_OK, "");
+    break;
+  case SSH_FXP_RENAME: {
+    const string oldpath = unpack_string(req, index);
+    const string newpath = unpack_string(req, index);
+    // Like OpenSSH, refuse to replace an existing file
+    if(lstat(newpath.c_str(), &sb) == 0)
+      reply_status(id, SSH_FX_FAILURE, "target exists");
+    else if(::rename(oldpath.c_str(), newpath.c_str()) < 0)
+      reply_errno(id, errno);
+    else
+      reply_status(id, SSH_FX_OK, "");
+    break;
+  }
+  case SSH_FXP_EXTENDED:
+    extended(id, req, index);
+    break;
+  default:
+    reply_unsupported(id);
+    break;
+  }
+}
+
+
+// Main Loop ------------------------------------------------------------------
+
+void sftp_serve(const char *extensions, bool extended) {
+  static const char *const all[] = {
+    POSIX_RENAME,
+    OPENSSH_LIMITS,
+    "check-file-name",
+    "check-file-handle",
+    AGENT_EXISTS,
+    AGENT_PUT,
+  };
+  string input;
+  size_t consumed = 0;                  // bytes of INPUT processed
+  bool eof = false;
+
+  for(size_t n = 0; n < sizeof all / sizeof *all; ++n)
+    if(("," + string(extensions) + ",").find(string(",") + all[n] + ",")
+       != string::npos)
+      offered.insert(all[n]);
+  extended_attrs = extended;
+  signal(SIGPIPE, SIG_IGN);
+  // Replies are buffered without limit so that we never block writing while
+  // the client is blocked writing to us
+  if(fcntl(1, F_SETFL, fcntl(1, F_GETFL) | O_NONBLOCK) < 0)
+    fatal("fcntl: %s", strerror(errno));
+  try {
+    for(;;) {
+      // Handle every complete request
+      while(input.size() - consumed >= 4) {
+        size_t index = consumed;
+        const uint32_t len = unpack_uint32(input, index);
+        if(input.size() - index < len)
+          break;
+        process(input.substr(index, len));
+        consumed = index + len;
+      }
+      input.erase(0, consumed);
+      consumed = 0;
+      if(eof && written == output.size())
+        break;
+      struct pollfd fds[2];
+      nfds_t nfds = 0;
+      if(!eof) {
+        fds[nfds].fd = 0;
+        fds[nfds].events = POLLIN;
+        ++nfds;
+      }
+      if(written < output.size()) {
+        fds[nfds].fd = 1;
+        fds[nfds].events = POLLOUT;
+        ++nfds;
+      }
+      if(poll(fds, nfds, -1) < 0) {
+        if(errno == EINTR)
+          continue;
+        fatal("poll: %s", strerror(errno));
+      }
+      for(nfds_t n = 0; n < nfds; ++n) {
+        if(!fds[n].revents)
+          continue;
+        if(fds[n].fd == 0) {
+          char buffer[65536];
+          const ssize_t bytes = read(0, buffer, sizeof buffer);
+          if(bytes < 0 && errno != EINTR && errno != EAGAIN)
+            fatal("reading requests: %s", strerror(errno));
+          if(bytes == 0)
+            eof = true;
+          else if(bytes > 0)
+            input.append(buffer, bytes);
+        } else {
+          const ssize_t bytes = write(1, output.data() + written,
+                                      output.size() - written);
+          if(bytes < 0) {
+            if(errno == EPIPE) {
+              eof = true;               // client has gone away
+              output.clear();
+              written = 0;
+              continue;
+            }
+            if(errno != EINTR && errno != EAGAIN)
+              fatal("writing replies: %s", strerror(errno));
+          } else {
+            // Erasing what was written after every write would copy the rest
+            // of a large backlog each time, so only discard it once it's all
+            // gone or is most of the buffer
+            written += bytes;
+            if(written == output.size()) {
+              output.clear();
+              written = 0;
+            } else if(written > output.size() / 2) {
+              output.erase(0, written);
+              written = 0;
+            }
+          }
+        }
+      }
+    }
+  } catch(out_of_range &) {
+    fatal("malformed SFTP request");
+  }
+  // Uploads the client never finished are of no use to anyone
+  while(uploads.size())
+    abandon(uploads.begin());
+}
+
+void do_agent() {
+  sftp_serve(POSIX_RENAME "," OPENSSH_LIMITS ","
+             "check-file-name,check-file-handle,"
+             AGENT_EXISTS "," AGENT_PUT);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -19,6 +19,7 @@
  */
 #include "nhbackup.h"
 #include <vector>
+#include <set>
 
 /* It is not sensible to store small files by hash.
  *
@@ -70,9 +71,320 @@ static void load_hints() {
   delete f;
 }
 
+// Return the hint for FULLNAME if it's still valid for a file with stat data
+// SB, else null
+static const hint *find_hint(const string &fullname, const struct stat &sb) {
+  map<string,hint>::const_iterator it;
+
+  if(hints
+     && (it = hints->find(fullname)) != hints->end()
+     && it->second.statdata.st_size == sb.st_size
+     && it->second.statdata.st_mtime == sb.st_mtime
+     && it->second.statdata.st_ctime == sb.st_ctime)
+    return &it->second;
+  return 0;
+}
+
+// Durability -----------------------------------------------------------------
+
+/* Without --sync, objects and the index are renamed into place as soon as they
+ * are written and nothing is ever synced, so after a crash an index may refer
+ * to objects whose contents never reached the disk.
+ *
+ * With --sync new objects are left under their temporary names and collected
+ * into a batch.  When the batch is big enough the data is flushed (one
+ * syncfs() for the whole repository, or an fdatasync() for each object where
+ * that is not available), then the objects are renamed into place, then each
+ * directory the renames touched is synced once.  An object is therefore never
+ * visible under its final name until its contents are durable.
+ *
+ * The index is only synced and renamed into place after the last batch, so it
+ * never refers to an object that might not survive a crash.
+ */
+
+struct pending_object {
+  string tmpname;                       // where it was written
+  string path;                          // where it belongs
+  inline pending_object(const string &t, const string &p):
+    tmpname(t), path(p) {}
+};
+
+static list<pending_object> pending;    // objects awaiting a sync
+static off_t pending_bytes;             // total size of pending objects
+static set<string> pending_dirs;        // directories created for them
+
+// Return the directory containing PATH
+static string parentdir(const string &path) {
+  const string::size_type n = path.rfind('/');
+
+  if(n == string::npos) return ".";
+  if(n == 0) return "/";
+  return string(path, 0, n);
+}
+
+// Return true if A and B name the same file in FS.  Only local files are
+// compared by inode; remote ones must have the same name.
+static bool samefile(Filesystem *fs, const string &a, const string &b) {
+  struct stat sa, sb;
+
+  if(a == b)
+    return true;
+  if(fs != &local)
+    return false;
+  if(stat(a.c_str(), &sa) < 0 || stat(b.c_str(), &sb) < 0)
+    return false;
+  return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+// Make all pending objects durable and rename them into place
+static void sync_objects() {
+  set<string> dirs;
+
+  if(pending.empty())
+    return;
+  try {
+    backupfs->syncfs(repo);
+  } catch(FileError &e) {
+    if(e.error() != ENOSYS) throw;
+    for(list<pending_object>::const_iterator it = pending.begin();
+        it != pending.end();
+        ++it)
+      backupfs->fsync(it->tmpname, true);
+  }
+  for(list<pending_object>::const_iterator it = pending.begin();
+      it != pending.end();
+      ++it) {
+    backupfs->rename(it->tmpname, it->path);
+    dirs.insert(parentdir(it->path));
+  }
+  // New fan-out directories must be durable in their parents too
+  dirs.insert(pending_dirs.begin(), pending_dirs.end());
+  for(set<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it)
+    backupfs->fsync(*it);
+  pending.clear();
+  pending_bytes = 0;
+  pending_dirs.clear();
+  ++sync_batches;
+}
+
+// Queue a newly written object to be renamed into place
+static void add_object(const string &tmpname, const string &path,
+                       off_t size) {
+  pending.push_back(pending_object(tmpname, path));
+  pending_bytes += size;
+  if(pending.size() >= SYNC_BATCH_OBJECTS || pending_bytes >= SYNC_BATCH_BYTES)
+    sync_objects();
+}
+
+// Record that DIR and possibly some of its parents were created in the
+// repository
+static void created_dirs(const string &dir) {
+  string d = dir;
+
+  while(d.size() > repo.size() && d.compare(0, repo.size(), repo) == 0) {
+    d = parentdir(d);
+    pending_dirs.insert(d);
+  }
+}
+
+// Repository Writers ---------------------------------------------------------
+
+/* New objects are copied into the repository by a pool of writer threads, so
+ * that reading and writing them overlaps with traversing and hashing the rest
+ * of the tree.  The traversal queues each object as soon as it finds it is
+ * needed; the queue has a fixed maximum length and the traversal waits for
+ * the writers when it is full.
+ *
+ * A local repository is written to by several threads at once.  An SFTP
+ * repository is only written in parallel with --sftp-connections, in which
+ * case each writer has a connection of its own.  Otherwise (or with --jobs 1
+ * locally) objects are written by the traversal thread at the end of each
+ * directory, as before.
+ */
+
+struct hashable {
+  string path;                          // source file
+  string hp;                            // path in repository
+  uint8_t hash[HASH_SIZE];
+  off_t size;
+  hashable(const string &p, const string &h, uint8_t hash_[], off_t size_):
+    path(p), hp(h), size(size_) {
+    memcpy(hash, hash_, HASH_SIZE);
+  }
+};
+
+// Writes objects into the repository and then waits for any installs, so that
+// their failures are reported too
+class WriteQueue: public WorkQueue {
+public:
+  inline WriteQueue(): WorkQueue(WRITE_QUEUE_LENGTH) {}
+protected:
+  void done(Filesystem *fs) { fs->finish_installs(); }
+};
+
+static WriteQueue *writeq;              // null if there are no writer threads
+
+// Copy H into the repository, accessed through FS, under a temporary name.
+// Returns false if the repository already has it, or if FS was able to
+// install it directly (in which case there is nothing for commit_object() to
+// do).  If any directories had to be created then DIR is set to the one the
+// object goes in.
+static bool write_object(const hashable &h, string &dir, Filesystem *fs) {
+  if(fs->exists(h.hp)) {
+    if(dropcache)
+      hostfs->uncache(h.path);
+    return false;
+  }
+  const string tmpname = h.hp + ".tmp";
+  // The repo doesn't have this file.  Copy it in.
+  File *f = hostfs->open(h.path, ReadOnly), *dst = 0;
+  Hash hashctx;
+  bool fast;
+
+  // With --sync the objects must be added to the durable set by
+  // commit_object(), so they can't be installed directly
+  if(!syncrepo) {
+    bool installed;
+    try {
+      installed = fs->install(h.hp, f, recheckhash ? h.hash : 0);
+    } catch(FileChanged &) {
+      delete f;
+      throw FileChanged(h.path);
+    } catch(...) {
+      delete f;
+      throw;
+    }
+    if(installed) {
+      delete f;
+      if(dropcache)
+        hostfs->uncache(h.path);
+      count(new_hashes);
+      return false;
+    }
+  }
+  try {
+    // In the long term the directories will usually exist, so try for the
+    // file open first.
+    try {
+      dst = fs->open(tmpname, Overwrite);
+    } catch(FileError &e) {
+      if(e.error() != ENOENT) throw;
+      dir = parentdir(h.hp);
+      fs->makedirs(dir);
+      dst = fs->open(tmpname, Overwrite);
+    }
+    // If the file can be cloned or copied in the kernel then do that, and
+    // check the hash of the copy afterwards.  Otherwise hash it as we copy
+    // it.
+    fast = dst->fastcopy(f);
+    if(!fast)
+      f->copyto(dst, recheckhash ? &hashctx : 0);
+    dst->flush();
+  } catch(...) {
+    delete f;
+    if(dst) delete dst;
+    throw;
+  }
+  delete f;
+  delete dst;
+  if(recheckhash) {
+    uint8_t copied_hash[HASH_SIZE];
+    const uint8_t *actual_hash;
+    if(fast) {
+      // The copy might not match the hash if the file changed after it was
+      // hashed, and nothing short of reading it can tell, even for a clone.
+      // hbackup.1 warns of the cost.
+      hashfile(fs, tmpname, copied_hash, true);
+      actual_hash = copied_hash;
+    } else
+      actual_hash = hashctx.value();
+    if(memcmp(actual_hash, h.hash, HASH_SIZE))
+      throw FileChanged(h.path);
+  }
+  if(dropcache) {
+    hostfs->uncache(h.path);
+    fs->uncache(tmpname);
+  }
+  return true;
+}
+
+// Move H, written by write_object() through FS, into place.  With writer
+// threads this is called with writeq locked if --sync is in force.
+static void commit_object(const hashable &h, const string &dir,
+                          Filesystem *fs) {
+  const string tmpname = h.hp + ".tmp";
+
+  if(syncrepo) {
+    if(dir.size())
+      created_dirs(dir);
+    add_object(tmpname, h.hp, h.size);
+  } else
+    fs->rename(tmpname, h.hp);
+  count(new_hashes);
+}
+
+// An object for a writer thread to write
+class WriteItem: public WorkItem {
+  hashable h;
+public:
+  inline WriteItem(const hashable &h_): h(h_) {}
+
+  void run(Filesystem *fs) {
+    string dir;
+    if(!write_object(h, dir, fs))
+      return;
+    // With --sync, commit_object() adds to the shared list of pending
+    // objects.  Otherwise renames needn't be serialized, and are slow over
+    // SFTP.
+    if(syncrepo) {
+      writeq->lock();
+      try {
+        commit_object(h, dir, fs);
+      } catch(...) {
+        writeq->unlock();
+        throw;
+      }
+      writeq->unlock();
+    } else
+      commit_object(h, dir, fs);
+  }
+};
+
+// Start the writer threads, if there are to be any
+static void start_writers() {
+  int nthreads = jobs ? jobs : DEFAULT_WRITERS;
+  vector<Filesystem *> fss;
+
+  if(backupfs != &local) {
+    // One writer per extra connection, regardless of --jobs.  Even a single
+    // writer lets the transfers overlap the traversal.
+    nthreads = reposessions.size();
+    if(!nthreads)
+      return;
+    // Connect before there are any other threads
+    for(int n = 0; n < nthreads; ++n)
+      reposessions[n]->init();
+  } else if(nthreads <= 1)
+    return;
+  for(int n = 0; n < nthreads; ++n)
+    fss.push_back(backupfs != &local ? reposessions[n] : backupfs);
+  writeq = new WriteQueue();
+  writeq->start(fss);
+}
+
+// Wait for the writer threads to write everything queued
+static void finish_writers() {
+  if(!writeq)
+    return;
+  writeq->finish();
+  delete writeq;
+  writeq = 0;
+}
+
 // Backup ---------------------------------------------------------------------
 
 static HashSet *inrepo;                 // hashes known to be in repo
+static vector<HashValue> *indexhashes;  // hashes the index refers to
 static void backup_dir(const string &root, const string &dir,
                        File *index);
 
@@ -85,22 +397,45 @@ void do_backup() {
   if(indexfile == "") fatal("no index specified");
 
   assert(hostfs == &local);             // remote not supported (yet)
+  if(syncrepo && backupfs != &local)
+    fatal("--sync requires a local repository");
   if(!overwrite_index && backupfs->exists(indexfile))
     fatal("index file %s already exists", indexfile.c_str());
+  // Overwriting the base would destroy it before it was read, and in any case
+  // the result would be a delta against itself
+  if(baseindex != "" && samefile(backupfs, baseindex, indexfile))
+    fatal("base index %s is the index being written", baseindex.c_str());
   if(!inrepo)
     inrepo = new HashSet();
+  indexhashes = new vector<HashValue>;
   if(hintfile != "") {
     hints = new map<string,hint>;
     load_hints();
     newhintfile = hintfile + ".tmp";
     newhints = local.open(newhintfile, Overwrite);
   }
-  File *o = backupfs->open(overwrite_index ? indexfile : indexfile + ".tmp",
-                           Overwrite);
+  // Get rid of the old index's manifest before the index starts changing, so
+  // that the two can never be mismatched.
+  if(overwrite_index && backupfs->exists(indexfile + MANIFEST_SUFFIX))
+    backupfs->remove(indexfile + MANIFEST_SUFFIX);
+  // Normally the index is written under a temporary name and only renamed
+  // into place at the end; --overwrite writes it in place instead.  --sync
+  // must not let it appear before the objects it refers to, so it always
+  // uses the temporary name.
+  const bool inplace = overwrite_index && !syncrepo;
+  const string newindex = inplace ? indexfile : indexfile + ".tmp";
+  File *o = createindex(backupfs, newindex);
+  if(baseindex != "")
+    o = createdelta(o, backupfs, baseindex);
+  start_writers();
   backup_dir(root, ".", o);
+  finish_writers();
+  backupfs->finish_installs();
   o->put("[end]\n");
-  o->flush();
+  o->finish();
   delete o;
+  if(syncrepo)
+    sync_objects();
   
   if(hints) {
     newhints->put("[end]\n");
@@ -109,17 +444,19 @@ void do_backup() {
     local.rename(newhintfile, hintfile);
   }
   
-  if(!overwrite_index) backupfs->rename(indexfile + ".tmp", indexfile);
-}
+  if(syncrepo)
+    backupfs->fsync(newindex);
+  if(!inplace) backupfs->rename(newindex, indexfile);
+  if(syncrepo)
+    backupfs->fsync(parentdir(indexfile));
 
-struct hashable {
-  const string path;
-  const string hp;
-  uint8_t hash[HASH_SIZE];
-  hashable(const string &p, const string &h, uint8_t hash_[]): path(p), hp(h) {
-    memcpy(hash, hash_, HASH_SIZE);
-  }
-};
+  // The manifest records the index's size and mtime, so it can only be written
+  // once the index is in place.  It is checksummed, so a torn one is just
+  // ignored and need not be synced separately.
+  write_manifest(backupfs, indexfile, *indexhashes);
+  delete indexhashes;
+  indexhashes = 0;
+}
 
 // Back up DIR
 static void backup_dir(const string &root, const string &dir,
@@ -130,7 +467,10 @@ static void backup_dir(const string &root, const string &dir,
   const string fulldir = root + (dir == "." ? "" : "/" + dir);
   bool first = true;
   list<hashable> hashables;
+  string hp;
+  vector<string>::const_iterator ahead;
   
+  index->boundary(dir);
   hostfs->contents(fulldir, c);
   // preallocate space for list of filenames
   ci.reserve(c.size());
@@ -178,6 +518,7 @@ static void backup_dir(const string &root, const string &dir,
   // that two backups of the same set of files produce the same index file, so
   // that diffs are easier to follow.
   sort(ci.begin(), ci.end());
+  ahead = ci.begin();
   // Now process all the files
   for(vector<string>::const_iterator it = ci.begin();
       it != ci.end();
@@ -187,29 +528,35 @@ static void backup_dir(const string &root, const string &dir,
     const string fullname = root + "/" + localname;
     const struct stat &sb = s[name];
     // figure out how to represent the name
-    string relname;
+    index->put("name=");
     if(first) {
       // At the start of a directory, or just after a subdirectory, always use
       // the full name.
-      relname = localname;
+      index->puturl(localname);
     } else {
       const string::size_type n = localname.rfind('/');
-      if(n != string::npos)
+      if(n != string::npos) {
         // For other names use the relative name...
-        relname = "./" + localname.substr(n + 1, string::npos);
-      else
+        index->put("./");
+        index->puturl(localname.data() + n + 1, localname.size() - (n + 1));
+      } else
         // ...except in the root directory.
-        relname = localname;
+        index->puturl(localname);
     }
-    // generic details
-    index->putf("name=%s&perms=%0#o&uid=%s&gid=%s&atime=%llu&ctime=%llu&mtime=%llu",
-                urlencode(relname).c_str(),
-                sb.st_mode & 07777,
-                urlencode(uid2string(sb.st_uid)).c_str(),
-                urlencode(gid2string(sb.st_gid)).c_str(),
-                (unsigned long long)sb.st_atime,
-                (unsigned long long)sb.st_ctime,
-                (unsigned long long)sb.st_mtime);
+    // generic details.  These are written directly into the index's buffer,
+    // rather than formatted with putf(), since there can be millions of them.
+    index->put("&perms=");
+    index->putoctal(sb.st_mode & 07777);
+    index->put("&uid=");
+    index->puturl(uid2string(sb.st_uid));
+    index->put("&gid=");
+    index->puturl(gid2string(sb.st_gid));
+    index->put("&atime=");
+    index->putu(sb.st_atime);
+    index->put("&ctime=");
+    index->putu(sb.st_ctime);
+    index->put("&mtime=");
+    index->putu(sb.st_mtime);
     first = false;
     // type-specific details
     if(S_ISREG(sb.st_mode)) {
@@ -224,56 +571,91 @@ static void backup_dir(const string &root, const string &dir,
           if(!bytes)
             fatal("unexpected EOF reading %s", fullname.c_str());
         }
-        index->putf("&data=%s",
-                    urlencode(string((char *)buffer, sb.st_size)).c_str());
+        index->put("&data=");
+        index->puturl((const char *)buffer, sb.st_size);
         delete f;
+        if(dropcache)
+          hostfs->uncache(fullname);
         ++small_files;
       } else {
         // The file is large so we store it in the filesystem by hash.
         uint8_t h[HASH_SIZE];
-        map<string,hint>::const_iterator it;
+        bool hashed = false, queued = false;
 
-        if(hints
-           && (it = hints->find(fullname)) != hints->end()
-           && it->second.statdata.st_size == sb.st_size
-           && it->second.statdata.st_mtime == sb.st_mtime
-           && it->second.statdata.st_ctime == sb.st_ctime) {
+        if(const hint *hi = find_hint(fullname, sb)) {
           // file hasn't changed since last time we hash it
-          memcpy(h, it->second.hash, HASH_SIZE);
+          memcpy(h, hi->hash, HASH_SIZE);
           ++hints_used;
         } else {
+          // Start reading the next file that will need hashing while this
+          // one is hashed
+          if(ahead <= it)
+            ahead = it + 1;
+          while(ahead != ci.end()) {
+            const string aheadname = root + "/"
+              + (dir == "." ? *ahead : dir + "/" + *ahead);
+            const struct stat &asb = s[*ahead++];
+            if(S_ISREG(asb.st_mode) && asb.st_size > STORE_LIMIT
+               && !find_hint(aheadname, asb)) {
+              hostfs->prefetch(aheadname);
+              break;
+            }
+          }
           hashfile(hostfs, fullname, h, sb.st_size >= MINMAP);
+          hashed = true;
         }
         if(hints) {
           // If we're saving hints, stash this one (regardless of whether we
           // hashed or not!)
-          newhints->putf("name=%s&%s=%s&ctime=%llu&mtime=%llu&size=%llu\n",
-                         urlencode(fullname).c_str(),
-                         HASH_NAME,
-                         hexencode(h, HASH_SIZE).c_str(),
-                         (unsigned long long)sb.st_ctime,
-                         (unsigned long long)sb.st_mtime,
-                         (unsigned long long)sb.st_size);
+          newhints->put("name=");
+          newhints->puturl(fullname);
+          newhints->put("&" HASH_NAME "=");
+          newhints->puthex(h, HASH_SIZE);
+          newhints->put("&ctime=");
+          newhints->putu(sb.st_ctime);
+          newhints->put("&mtime=");
+          newhints->putu(sb.st_mtime);
+          newhints->put("&size=");
+          newhints->putu(sb.st_size);
+          newhints->put('\n');
         }
         // see if we've got it
         if(!inrepo->has(h)) {
           // We don't know for sure that the repo already has this file.  Check
           // it directly.
-          const string hp = repo + "/" + HASH_NAME + "/" + hashpath(h);
-          backupfs->prefigure_exists(hp);
-          hashables.push_back(hashable(fullname, hp, h));
+          objectpath(hp, h);
+          if(writeq)
+            writeq->add(new WriteItem(hashable(fullname, hp, h, sb.st_size)));
+          else {
+            backupfs->prefigure_exists(hp);
+            hashables.push_back(hashable(fullname, hp, h, sb.st_size));
+          }
           // The repo now has the file either way
           inrepo->insert(h);
+          queued = true;
         }
-        index->putf("&%s=%s", HASH_NAME, hexencode(h, HASH_SIZE).c_str());
+        // Files that are to be copied are dropped from the cache afterwards
+        if(dropcache && hashed && !queued)
+          hostfs->uncache(fullname);
+        index->put("&" HASH_NAME "=");
+        index->puthex(h, HASH_SIZE);
+        indexhashes->push_back(HashValue());
+        memcpy(indexhashes->back().h, h, HASH_SIZE);
       }
       // If number of links is nontrivial record the inode number so the
       // restore process can connect hard links back together
-      if(sb.st_nlink > 1)
-        index->putf("&inode=%llu", sb.st_ino);
+      if(sb.st_nlink > 1) {
+        index->put("&inode=");
+        index->putu(sb.st_ino);
+      }
       index->put('\n');
-      // Restore the atime
-      if(preserve_atime) {
+      // Restore the atime.  Files are read with O_NOATIME where possible,
+      // and might not have been read at all, so only do this if it actually
+      // changed: utimes() updates the ctime, which defeats the hints.
+      struct stat nsb;
+      if(preserve_atime
+         && lstat(fullname.c_str(), &nsb) == 0
+         && nsb.st_atime != sb.st_atime) {
         struct timeval tv[2];
 
         // TODO subsecond timestamps
@@ -286,16 +668,19 @@ static void backup_dir(const string &root, const string &dir,
       }
       ++total_regular_files;
     } else if(S_ISDIR(sb.st_mode)) {
-      index->putf("&type=dir\n");
+      index->put("&type=dir\n");
       if(crossfs || !hostfs->ismount(fullname))
         dirs.push_back(localname);
     } else if(S_ISLNK(sb.st_mode)) {
-      index->putf("&target=%s&type=link\n",
-                  urlencode(hostfs->readlink(fullname)).c_str());
+      index->put("&target=");
+      index->puturl(hostfs->readlink(fullname));
+      index->put("&type=link\n");
       ++total_links;
     } else if(S_ISCHR(sb.st_mode) || S_ISBLK(sb.st_mode)) {
-      index->putf("&rdev=%d&type=%s\n",
-                  sb.st_rdev, S_ISCHR(sb.st_mode) ? "chr" : "blk");
+      // This used to be written with %d, so keep the same truncation
+      index->put("&rdev=");
+      index->putd((int)sb.st_rdev);
+      index->put(S_ISCHR(sb.st_mode) ? "&type=chr\n" : "&type=blk\n");
       ++total_devs;
     } else if(S_ISSOCK(sb.st_mode)) {
       index->put("&type=socket\n");
@@ -309,40 +694,9 @@ static void backup_dir(const string &root, const string &dir,
   for(list<hashable>::const_iterator it = hashables.begin();
       it != hashables.end();
       ++it) {
-    if(!backupfs->exists(it->hp)) {
-      const string &tmpname = it->hp + ".tmp";
-      // The repo doesn't have this file.  Copy it in.
-      File *f = hostfs->open(it->path, ReadOnly), *dst;
-      int n;
-      static char buffer[4096];
-      Hash hashctx;
-      
-      // In the long term the directories will usually exist, so try for
-      // the file open first.
-      try {
-        dst = backupfs->open(tmpname, Overwrite);
-      } catch(FileError &e) {
-        if(e.error() != ENOENT) throw;
-        backupfs->makedirs(string(it->hp, 0, it->hp.rfind('/')));
-        // TODO use dirname() above
-        dst = backupfs->open(tmpname, Overwrite);
-      }
-      while((n = f->getbytes(buffer, sizeof buffer, false))) {
-        dst->put(buffer, n);
-        if(recheckhash)
-          hashctx.write(buffer, n);
-      }
-      if(recheckhash) {
-        const uint8_t *const actual_hash = hashctx.value();
-        if(memcmp(actual_hash, it->hash, HASH_SIZE))
-          fatal("%s changed hash between test and write", it->path.c_str());
-      }
-      dst->flush();
-      delete f;
-      delete dst;
-      backupfs->rename(tmpname, it->hp);
-      ++new_hashes;
-    }
+    string dir;
+    if(write_object(*it, dir, backupfs))
+      commit_object(*it, dir, backupfs);
   }
   // And now deal with the subdirectories.  The consequence of doing the
   // directories last is that if you know the start of a directory's contents
@@ -360,6 +714,40 @@ static void backup_dir(const string &root, const string &dir,
     backup_dir(root, *it, index);
 }
 
+// Repository Setup -----------------------------------------------------------
+
+// Create all the fan-out directories of a repository in one go, so that
+// backups into it never find one missing
+void do_init_repo() {
+  if(repo == "") fatal("no repository specified");
+  if(root != "") fatal("root specified for --init-repo");
+  if(indexfile != "") fatal("index specified for --init-repo");
+
+  list<string> dirs, level;
+  char suffix[4];
+
+  backupfs->makedirs(repo);
+  level.push_back(repo + "/" HASH_NAME);
+  dirs = level;
+  // Parents go before their children
+  for(int depth = 0; depth < DEPTH; ++depth) {
+    list<string> next;
+    for(list<string>::const_iterator it = level.begin();
+        it != level.end();
+        ++it)
+      for(int n = 0; n < 256; ++n) {
+        snprintf(suffix, sizeof suffix, "/%02x", n);
+        next.push_back(*it + suffix);
+      }
+    dirs.insert(dirs.end(), next.begin(), next.end());
+    level.swap(next);
+  }
+  backupfs->mkdirs(dirs);
+  if(verbose)
+    fprintf(stderr, "%lu repository directories present\n",
+            (unsigned long)dirs.size());
+}
+
 /*
 Local Variables:
 c-basic-offset:2
@@ -21,45 +21,180 @@
 
 // Clean --------------------------------------------------------------------
 
-static unsigned long long clean_recurse(const HashSet *needed, 
-                                        const string &path);
+// One live index, as read by scan_index()
+struct IndexScan {
+  const char *path;                     // index filename
+  bool manifest;                        // it's really a hash manifest
+  bool bad;                             // it contains bad hashes or lines
+  bool done;                            // scan complete
+  string failure;                       // fatal error, if nonempty
+  vector<HashValue> hashes;             // hashes it refers to
+  list<DivertedMessage> messages;       // warnings and errors to report
 
-// Perform cleanup, taking ARGV as list of live indexes
-void do_clean(int argc, char **argv) {
-  HashSet *needed;
-  uint8_t h[HASH_SIZE];
+  inline IndexScan(): path(0), manifest(false), bad(false), done(false) {}
+};
+
+// State shared between cleanup's index-reading threads
+struct ScanQueue {
+  vector<IndexScan> scans;              // one for each index
+  size_t next;                          // next index to read
+  size_t reported;                      // indexes reported so far
+  size_t window;                        // how far next may run ahead
+  pthread_mutex_t lock;
+  pthread_cond_t cond;                  // signaled when anything changes
+};
+
+// What cleanup found in the repository
+struct CleanStats {
+  unsigned long long objects, bytes;    // all objects
+  unsigned long long obsolete, obsolete_bytes; // objects no index needs
+
+  inline CleanStats(): objects(0), bytes(0), obsolete(0), obsolete_bytes(0) {}
+};
+
+static void clean_recurse(const HashSet *needed, const string &path,
+                          CleanStats &stats, list<string> &doomed);
+
+// Read the hashes that S's index refers to.  Warnings and errors are saved
+// in S so that they can be reported in order.
+static void scan_index(IndexScan &s) {
   map<string,string> details;
-  list<const char *> badfiles;
+  HashValue v;
 
-  if(repo == "") fatal("no repository specified");
-  if(argc == 0) fatal("no index files specified");
-  // construct the set of files that do exist
-  needed = new HashSet();
-  for(int n = 0; n < argc; ++n) {
-    if(verbose)
-      fprintf(stderr, "checking %s\n", argv[n]);
-    File *f = backupfs->open(argv[n], ReadOnly);
+  divert_messages(&s.messages);
+  try {
+    // Manifests are picked up along with their indexes, so if the caller
+    // supplied a glob that matched them too, ignore them.
+    if(is_manifest(backupfs, s.path)) {
+      s.manifest = true;
+      return;
+    }
+    if(read_manifest(backupfs, s.path, s.hashes))
+      return;
+    File *f = openindex(backupfs, s.path);
     try {
       try {
         while(readIndexLine(f, details)) {
           if(const string *hash = getdetail(details, HASH_NAME)) {
-            hashdecode(*hash, h);
-            needed->insert(h);
+            hashdecode(*hash, v.h);
+            s.hashes.push_back(v);
           }
         }
       } catch(BadHex) {
-        badfiles.push_back(argv[n]);
+        s.bad = true;
       } catch(BadHexDigit) {
-        badfiles.push_back(argv[n]);
+        s.bad = true;
       } catch(BadIndexFile &bif) {
         error("%s", bif.what());
-        badfiles.push_back(argv[n]);
+        s.bad = true;
       }
     } catch(...) {
       delete f;
       throw;
     }
     delete f;
+  } catch(exception &e) {
+    s.failure = e.what();
+  }
+  divert_messages(0);
+}
+
+// Thread that reads indexes from Q until there are none left
+static void *scan_thread(void *arg) {
+  ScanQueue *const q = (ScanQueue *)arg;
+
+  pthread_mutex_lock(&q->lock);
+  for(;;) {
+    while(q->next < q->scans.size() && q->next >= q->reported + q->window)
+      pthread_cond_wait(&q->cond, &q->lock);
+    if(q->next >= q->scans.size())
+      break;
+    IndexScan &s = q->scans[q->next++];
+    pthread_mutex_unlock(&q->lock);
+    scan_index(s);
+    pthread_mutex_lock(&q->lock);
+    s.done = true;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+// Perform cleanup, taking ARGV as list of live indexes
+void do_clean(int argc, char **argv) {
+  HashSet *needed;
+  list<const char *> badfiles;
+  ScanQueue q;
+  vector<pthread_t> threads;
+  int nthreads = jobs;
+
+  if(repo == "") fatal("no repository specified");
+  if(argc == 0) fatal("no index files specified");
+  q.scans.resize(argc);
+  for(int n = 0; n < argc; ++n)
+    q.scans[n].path = argv[n];
+  q.next = q.reported = 0;
+  if(nthreads == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = cpus > 0 ? cpus : 1;
+  }
+  // Only local repositories can be read by several threads at once.
+  if(backupfs != &local)
+    nthreads = 1;
+  if(nthreads > argc)
+    nthreads = argc;
+  // Don't let the threads get too far ahead, since every index they have
+  // read but we haven't yet merged is holding its hashes in memory.
+  q.window = 2 * nthreads;
+  if(nthreads > 1) {
+    pthread_mutex_init(&q.lock, 0);
+    pthread_cond_init(&q.cond, 0);
+    threads.resize(nthreads);
+    for(int n = 0; n < nthreads; ++n) {
+      int rc;
+      if((rc = pthread_create(&threads[n], 0, scan_thread, &q)))
+        fatal("pthread_create: %s", strerror(rc));
+    }
+  }
+  // construct the set of files that do exist, reporting on each index in
+  // the order given
+  needed = new HashSet();
+  for(int n = 0; n < argc; ++n) {
+    IndexScan &s = q.scans[n];
+
+    if(nthreads > 1) {
+      pthread_mutex_lock(&q.lock);
+      while(!s.done)
+        pthread_cond_wait(&q.cond, &q.lock);
+      pthread_mutex_unlock(&q.lock);
+    } else
+      scan_index(s);
+    if(!s.manifest) {
+      if(verbose)
+        fprintf(stderr, "checking %s\n", s.path);
+      replay_messages(s.messages);
+      if(s.failure.size())
+        fatal("%s", s.failure.c_str());
+      for(vector<HashValue>::const_iterator it = s.hashes.begin();
+          it != s.hashes.end();
+          ++it)
+        needed->insert(it->h);
+      if(s.bad)
+        badfiles.push_back(s.path);
+    }
+    vector<HashValue>().swap(s.hashes);
+    if(nthreads > 1) {
+      pthread_mutex_lock(&q.lock);
+      ++q.reported;
+      pthread_cond_broadcast(&q.cond);
+      pthread_mutex_unlock(&q.lock);
+    }
+  }
+  if(nthreads > 1) {
+    for(int n = 0; n < nthreads; ++n)
+      pthread_join(threads[n], 0);
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
   }
   if(badfiles.size()) {
     for(list<const char *>::const_iterator it = badfiles.begin();
@@ -74,29 +209,40 @@ void do_clean(int argc, char **argv) {
   // delete everything not in the set
   if(verbose)
     fprintf(stderr, "looking for obsolete files\n");
-  const unsigned long long deleted = clean_recurse(needed,
-                                                   repo + "/" + HASH_NAME);
-  if(verbose)
-    fprintf(stderr, "found %llu obsolete files\n", deleted);
+  CleanStats stats;
+  list<string> doomed;
+  clean_recurse(needed, repo + "/" + HASH_NAME, stats, doomed);
+  if(doomed.size())
+    backupfs->removes(doomed);
+  if(verbose) {
+    fprintf(stderr, "repository holds %llu objects (%llu bytes)\n",
+            stats.objects, stats.bytes);
+    fprintf(stderr, "found %llu obsolete files (%llu bytes)\n",
+            stats.obsolete, stats.obsolete_bytes);
+  }
 }
 
-// Recurse through repository, listing/delete obsolete files
-static unsigned long long clean_recurse(const HashSet *needed, 
-                                        const string &path) {
-  list<string> files;
+// Recurse through repository, listing obsolete files or adding them to
+// DOOMED.  Deletions are made in batches, since a remote repository can have
+// a whole batch in flight at once, but most object directories hold only one
+// or two objects so a batch spans many directories.
+static void clean_recurse(const HashSet *needed, const string &path,
+                          CleanStats &stats, list<string> &doomed) {
+  list<DirEntry> files;
   uint8_t h[HASH_SIZE];
   bool keep;                            // keep this file?
-  unsigned long long deleted = 0;
 
-  backupfs->contents(path, files);
-  for(list<string>::const_iterator it = files.begin();
+  backupfs->scan(path, files);
+  for(list<DirEntry>::const_iterator it = files.begin();
       it != files.end();
       ++it) {
-    const string &name = *it;
+    const string &name = it->name;
     const string fullname = path + "/" + name;
 
-    switch(backupfs->type(fullname)) {
+    switch(it->type) {
     case RegularFile:
+      ++stats.objects;
+      stats.bytes += it->size;
       try {
         hashdecode(name, h);
         keep = needed->has(h);
@@ -112,29 +258,28 @@ static unsigned long long clean_recurse(const HashSet *needed,
         keep = false;
       }
       if(!keep) {
-        if(deleteclean) {
-          try {
-            backupfs->remove(fullname);
-          } catch(FileError &e) {
-            // don't crap out if we run into a file we cannot delete
-            error("%s", e.what());
-          }
-        } else
+        if(deleteclean)
+          doomed.push_back(fullname);
+        else
           if(puts(fullname.c_str()) < 0)
             fatal("error writing to stdout: %s", strerror(errno));
-        ++deleted;
+        ++stats.obsolete;
+        stats.obsolete_bytes += it->size;
       }
       break;
     case Directory:
       // clean subdirectory
-      deleted += clean_recurse(needed, fullname);
+      clean_recurse(needed, fullname, stats, doomed);
       break;
     default:
       // do nothing
       break;
     }
   }
-  return deleted;
+  if(doomed.size() >= SFTP_REQUEST_WINDOW) {
+    backupfs->removes(doomed);
+    doomed.clear();
+  }
 }
 
 /*
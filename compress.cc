@@ -0,0 +1,230 @@
+/*
+ * This file is part of hbackup.
+ * Copyright (C) 2009 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+#include "nhbackup.h"
+#if HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+// Compressed Index Files -----------------------------------------------------
+
+// First four bytes of a zstd frame
+static const uint8_t zstd_magic[4] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+#if HAVE_ZSTD
+
+// Skippable frame used for the directory offset table.  Decompressors ignore
+// it.
+static const uint32_t table_magic = 0x184D2A5E;
+
+// Last four bytes of a compressed index
+static const char table_trailer[4] = { 'h', 'b', 'd', 't' };
+
+// A zstd-compressed index file.
+//
+// The index is written as a sequence of independent frames.  Each frame
+// starts at the beginning of a directory (but may contain many directories),
+// so a reader can start decompressing at any frame boundary and find whole
+// index lines with full names.
+//
+// The last frame is a skippable frame containing the directory offset table.
+// This has one line for each compressed frame, in the same format as index
+// lines, giving the directory at the start of the frame, the offset of the
+// frame within the compressed file and the corresponding offset in the
+// uncompressed data.  It ends with a 32-bit little-endian count of the bytes
+// in the whole skippable frame, and the four bytes "hbdt", so that it can be
+// found from the end of the file.
+class ZstdFile : public File {
+private:
+  File *raw;                            // compressed data
+  string path;                          // for error messages
+  ZSTD_CCtx *cctx;                      // when writing
+  ZSTD_DCtx *dctx;                      // when reading
+  vector<char> zbuffer;                 // compressed bytes
+  ZSTD_inBuffer zin;                    // compressed bytes not yet consumed
+  bool raweof;                          // no more compressed bytes
+  bool inframe;                         // partway through a frame
+  uint64_t offset;                      // compressed bytes written
+  uint64_t position;                    // uncompressed bytes written
+  uint64_t framestart;                  // position at start of frame
+  string table;                         // directory offset table
+
+public:
+  ZstdFile(File *raw_, const string &path_, bool writing);
+  ~ZstdFile();
+  void finish();
+  void boundary(const string &dir);
+
+private:
+  int readbytes(void *buf, int space);
+  void writebytes(const void *buf, int nbytes);
+  size_t compress(ZSTD_inBuffer &in, ZSTD_EndDirective directive);
+  void put32(uint32_t u);
+};
+
+ZstdFile::ZstdFile(File *raw_, const string &path_, bool writing):
+  raw(raw_), path(path_), cctx(0), dctx(0),
+  raweof(false), inframe(false),
+  offset(0), position(0), framestart(0) {
+  zin.src = 0;
+  zin.size = zin.pos = 0;
+  if(writing) {
+    if(!(cctx = ZSTD_createCCtx()))
+      fatal("ZSTD_createCCtx failed");
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                           INDEX_COMPRESSION_LEVEL);
+    zbuffer.resize(ZSTD_CStreamOutSize());
+  } else {
+    if(!(dctx = ZSTD_createDCtx()))
+      fatal("ZSTD_createDCtx failed");
+    zbuffer.resize(ZSTD_DStreamInSize());
+  }
+}
+
+ZstdFile::~ZstdFile() {
+  if(cctx) ZSTD_freeCCtx(cctx);
+  if(dctx) ZSTD_freeDCtx(dctx);
+  delete raw;
+}
+
+int ZstdFile::readbytes(void *buf, int space) {
+  ZSTD_outBuffer out = { buf, (size_t)space, 0 };
+
+  while(!out.pos) {
+    if(zin.pos == zin.size && !raweof) {
+      const int n = raw->getbytes(&zbuffer[0], zbuffer.size(), false);
+      if(n) {
+        zin.src = &zbuffer[0];
+        zin.size = n;
+        zin.pos = 0;
+      } else
+        raweof = true;
+    }
+    if(zin.pos == zin.size && raweof && !inframe)
+      return 0;                         // clean EOF
+    const size_t r = ZSTD_decompressStream(dctx, &out, &zin);
+    if(ZSTD_isError(r))
+      throw CompressionError(path, ZSTD_getErrorName(r));
+    inframe = r != 0;
+    if(!out.pos && zin.pos == zin.size && raweof && inframe)
+      throw CompressionError(path, "truncated compressed data");
+  }
+  return out.pos;
+}
+
+void ZstdFile::writebytes(const void *buf, int nbytes) {
+  ZSTD_inBuffer in = { buf, (size_t)nbytes, 0 };
+
+  while(in.pos < in.size)
+    compress(in, ZSTD_e_continue);
+  position += nbytes;
+}
+
+// Feed IN to the compressor and write out whatever it produces.  Returns
+// ZSTD_compressStream2()'s hint, i.e. 0 when a flush or end is complete.
+size_t ZstdFile::compress(ZSTD_inBuffer &in, ZSTD_EndDirective directive) {
+  ZSTD_outBuffer out = { &zbuffer[0], zbuffer.size(), 0 };
+
+  const size_t r = ZSTD_compressStream2(cctx, &out, &in, directive);
+  if(ZSTD_isError(r))
+    throw CompressionError(path, ZSTD_getErrorName(r));
+  raw->put(&zbuffer[0], out.pos);
+  offset += out.pos;
+  return r;
+}
+
+void ZstdFile::boundary(const string &dir) {
+  if(!table.empty()) {
+    // Don't start a new frame until the current one is big enough
+    const size_t pending = mode == writing ? next - buffer : 0;
+    if(position + pending - framestart < INDEX_FRAME_SIZE)
+      return;
+    flush();
+    ZSTD_inBuffer in = { 0, 0, 0 };
+    while(compress(in, ZSTD_e_end))
+      ;
+  }
+  char numbers[64];
+  snprintf(numbers, sizeof numbers, "&offset=%llu&position=%llu\n",
+           (unsigned long long)offset, (unsigned long long)position);
+  table += "name=" + urlencode(dir) + numbers;
+  framestart = position;
+}
+
+void ZstdFile::put32(uint32_t u) {
+  raw->put(u & 0xFF);
+  raw->put((u >> 8) & 0xFF);
+  raw->put((u >> 16) & 0xFF);
+  raw->put((u >> 24) & 0xFF);
+}
+
+void ZstdFile::finish() {
+  flush();
+  // End the last data frame
+  ZSTD_inBuffer in = { 0, 0, 0 };
+  while(compress(in, ZSTD_e_end))
+    ;
+  // Write the directory offset table
+  const uint32_t payload = table.size() + 8;
+  put32(table_magic);
+  put32(payload);
+  raw->put(table);
+  put32(payload + 8);
+  raw->put(table_trailer, sizeof table_trailer);
+  raw->finish();
+}
+
+#endif
+
+File *openindex(Filesystem *fs, const string &path) {
+  File *f = fs->open(path, ReadOnly);
+  try {
+    if(f->lookingat(zstd_magic, sizeof zstd_magic)) {
+#if HAVE_ZSTD
+      f = new ZstdFile(f, path, false);
+#else
+      throw CompressionError(path, "compressed indexes not supported");
+#endif
+    }
+    if(f->lookingat("[delta ", 7))
+      f = resolvedelta(f, fs);
+  } catch(...) {
+    delete f;
+    throw;
+  }
+  return f;
+}
+
+File *createindex(Filesystem *fs, const string &path) {
+  File *f = fs->open(path, Overwrite);
+#if HAVE_ZSTD
+  if(compressindex)
+    return new ZstdFile(f, path, true);
+#endif
+  return f;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
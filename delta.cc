@@ -0,0 +1,346 @@
+/*
+ * This file is part of hbackup.
+ * Copyright (C) 2009 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+#include "nhbackup.h"
+
+/* A delta index records only the directories that changed since some base
+ * index.  It starts with a line
+ *
+ *   [delta BASE]
+ *
+ * where BASE is the URL-encoded path to the base index.  After that, lines
+ * are either ordinary index lines, which are passed through unchanged, or
+ * one of:
+ *
+ *   [copy N]      copy the next N directories from the base
+ *   [skip N]      discard the next N directories from the base
+ *
+ * followed by the usual [end] line.  Both indexes list directories in the
+ * same order, so the base is only ever read forwards, and resolving a delta
+ * needs only one directory of either file in memory at a time.
+ */
+
+// Index Blocks ---------------------------------------------------------------
+
+// Set DIR to the directory of the index line LINE and return true, or return
+// false if LINE has a relative name (and so continues the current directory).
+static bool linedir(const string &line, string &dir) {
+  if(line.compare(0, 5, "name="))
+    throw BadIndexFile(line);           // backup always writes name first
+  string::size_type end = line.find('&');
+  if(end == string::npos)
+    end = line.size();
+  if(line.compare(5, 2, "./") == 0)
+    return false;
+  const string name = urldecode(line, 5, end);
+  const string::size_type n = name.rfind('/');
+  if(n != string::npos)
+    dir.assign(name, 0, n);
+  else
+    dir.clear();
+  return true;
+}
+
+IndexBlockReader::IndexBlockReader(File *f_): f(f_), lookahead(false) {
+}
+
+bool IndexBlockReader::next(string &dir, string &text) {
+  string d;
+
+  text.clear();
+  if(!lookahead && !f->getline(line))
+    throw BadIndexFile("unexpected end of file");
+  lookahead = false;
+  if(line == "[end]") {
+    lookahead = true;                   // stay at the end
+    return false;
+  }
+  if(!linedir(line, dir))
+    throw BadIndexFile("unexpected relative name: " + line);
+  do {
+    text += line;
+    text += '\n';
+    if(!f->getline(line))
+      throw BadIndexFile("unexpected end of file");
+  } while(line != "[end]" && (!linedir(line, d) || d == dir));
+  lookahead = true;
+  return true;
+}
+
+// Delta Writer ---------------------------------------------------------------
+
+// Writes a delta index.  backup_dir() writes each directory's lines in one
+// go and calls boundary() before starting the next, so the bytes between
+// boundaries are exactly one directory's worth.
+class DeltaWriter : public File {
+private:
+  File *out;                            // delta output
+  File *base;                           // base index
+  IndexBlockReader blocks;              // base index, a directory at a time
+  bool havebase;                        // base block is valid
+  string basedir, basetext;             // current base block
+  string dir, text;                     // block being written
+  char op;                              // pending operation ('c'/'s'/0)
+  unsigned long long count;             // repeat count for OP
+
+public:
+  DeltaWriter(File *out_, File *base_, const string &basepath);
+  ~DeltaWriter();
+  void boundary(const string &dir);
+  void finish();
+
+private:
+  void writebytes(const void *buf, int nbytes);
+  void block();
+  void advance();
+  void operation(char what);
+  void flushop();
+};
+
+DeltaWriter::DeltaWriter(File *out_, File *base_, const string &basepath):
+  out(out_), base(base_), blocks(base_), havebase(false), op(0), count(0) {
+  out->put("[delta " + urlencode(basepath) + "]\n");
+  advance();
+}
+
+DeltaWriter::~DeltaWriter() {
+  delete base;
+  delete out;
+}
+
+void DeltaWriter::writebytes(const void *buf, int nbytes) {
+  text.append((const char *)buf, nbytes);
+}
+
+// Read the next base block
+void DeltaWriter::advance() {
+  havebase = blocks.next(basedir, basetext);
+}
+
+// Record one more base block to copy or skip
+void DeltaWriter::operation(char what) {
+  if(op != what)
+    flushop();
+  op = what;
+  ++count;
+  advance();
+}
+
+// Write out any pending operation
+void DeltaWriter::flushop() {
+  if(op) {
+    char buffer[64];
+    snprintf(buffer, sizeof buffer, "[%s %llu]\n",
+             op == 'c' ? "copy" : "skip", count);
+    out->put(buffer);
+    op = 0;
+    count = 0;
+  }
+}
+
+// Deal with the block just completed
+void DeltaWriter::block() {
+  if(text.empty())
+    return;                             // empty directory
+  // Discard base directories that have gone away
+  while(havebase && compare_dirs(basedir, dir) < 0)
+    operation('s');
+  if(havebase && basedir == dir) {
+    // Merely reading a file can change its atime, so a directory that differs
+    // only in atimes and ctimes still counts as unchanged.  The base's values
+    // are the ones kept.
+    if(same_index_text(basetext, text)) {
+      operation('c');
+      ++reused_dirs;
+      text.clear();
+      return;
+    }
+    operation('s');
+  }
+  flushop();
+  out->put(text);
+  text.clear();
+}
+
+void DeltaWriter::boundary(const string &newdir) {
+  flush();
+  block();
+  dir = newdir == "." ? "" : newdir;
+  out->boundary(newdir);
+}
+
+void DeltaWriter::finish() {
+  flush();
+  // The last thing written is the [end] line, which isn't part of the last
+  // directory.
+  static const string end = "[end]\n";
+  if(text.size() < end.size()
+     || text.compare(text.size() - end.size(), end.size(), end))
+    fatal("delta index not terminated");
+  text.erase(text.size() - end.size());
+  block();
+  flushop();
+  out->put(end);
+  out->finish();
+}
+
+File *createdelta(File *index, Filesystem *fs, const string &basepath) {
+  File *base = openindex(fs, basepath);
+  try {
+    return new DeltaWriter(index, base, basepath);
+  } catch(...) {
+    delete base;
+    throw;
+  }
+}
+
+// Delta Resolver -------------------------------------------------------------
+
+// Presents a delta index and its base as a single ordinary index
+class DeltaFile : public File {
+private:
+  File *delta;                          // the delta index
+  File *base;                           // the base index
+  IndexBlockReader blocks;              // base index, a directory at a time
+  string pending;                       // bytes not yet returned
+  size_t used;                          // bytes of pending already returned
+  unsigned long long copying;           // base blocks left to copy
+  bool done;                            // seen [end]
+
+public:
+  DeltaFile(File *delta_, File *base_);
+  ~DeltaFile();
+
+private:
+  int readbytes(void *buf, int space);
+  void refill();
+};
+
+DeltaFile::DeltaFile(File *delta_, File *base_):
+  delta(delta_), base(base_), blocks(base_), used(0), copying(0),
+  done(false) {
+}
+
+DeltaFile::~DeltaFile() {
+  delete base;
+  delete delta;
+}
+
+// Get the next lump of resolved index into pending
+void DeltaFile::refill() {
+  string line, dir;
+
+  pending.clear();
+  used = 0;
+  while(pending.empty()) {
+    if(copying) {
+      if(!blocks.next(dir, pending))
+        throw BadIndexFile("delta refers past end of base index");
+      --copying;
+    } else {
+      if(done || !delta->getline(line))
+        return;                         // EOF
+      if(line[0] != '[') {
+        pending = line;
+        pending += '\n';
+      } else if(line == "[end]") {
+        pending = "[end]\n";
+        done = true;
+      } else {
+        char what[8];
+        unsigned long long count;
+        char junk;
+        if(sscanf(line.c_str(), "[%7s %llu%c", what, &count, &junk) != 3
+           || junk != ']')
+          throw BadIndexFile(line);
+        if(!strcmp(what, "copy"))
+          copying = count;
+        else if(!strcmp(what, "skip")) {
+          while(count-- > 0)
+            if(!blocks.next(dir, pending))
+              throw BadIndexFile("delta refers past end of base index");
+          pending.clear();
+        } else
+          throw BadIndexFile(line);
+      }
+    }
+  }
+}
+
+int DeltaFile::readbytes(void *buf, int space) {
+  if(used == pending.size())
+    refill();
+  const size_t left = pending.size() - used;
+  if((size_t)space > left)
+    space = left;
+  memcpy(buf, pending.data() + used, space);
+  used += space;
+  return space;
+}
+
+File *resolvedelta(File *delta, Filesystem *fs) {
+  string header;
+
+  if(!delta->getline(header)
+     || header.compare(0, 7, "[delta ")
+     || header[header.size() - 1] != ']')
+    throw BadIndexFile(header);
+  const string basepath = urldecode(header, 7, header.size() - 1);
+  File *base = openindex(fs, basepath);
+  return new DeltaFile(delta, base);
+}
+
+// Compaction -----------------------------------------------------------------
+
+// Rewrite the index as a full index
+void do_compact() {
+  if(indexfile == "") fatal("no index specified");
+  if(root != "") fatal("root specified for --compact-index");
+  File *in = openindex(backupfs, indexfile), *out = 0;
+  const string tmp = indexfile + ".tmp";
+
+  try {
+    IndexBlockReader blocks(in);
+    string dir, text;
+
+    out = createindex(backupfs, tmp);
+    while(blocks.next(dir, text)) {
+      out->boundary(dir == "" ? "." : dir);
+      out->put(text);
+    }
+    out->put("[end]\n");
+    out->finish();
+  } catch(...) {
+    delete in;
+    if(out) delete out;
+    throw;
+  }
+  delete in;
+  delete out;
+  backupfs->rename(tmp, indexfile);
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,224 @@
+/*
+ * This file is part of hbackup.
+ * Copyright (C) 2009 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+#include "nhbackup.h"
+
+/* Both indexes list directories in the order backup_dir() visits them (see
+ * compare_dirs()) and the entries within each directory in sorted order, so
+ * they can be compared with a single merge pass, holding only one directory
+ * from each in memory.
+ */
+
+// Index Diff -----------------------------------------------------------------
+
+// One line of an index
+struct DiffEntry {
+  string name;                          // name within its directory
+  string line;                          // the whole line
+  size_t rest;                          // offset of the details in line
+};
+
+// Details that don't count as changes.  The name is compared separately.
+static bool ignored_detail(const string &key) {
+  return key == "name" || volatile_detail(key);
+}
+
+// Split a block of index lines into entries
+static void split_block(const string &text, vector<DiffEntry> &entries) {
+  size_t pos = 0;
+  DiffEntry e;
+
+  entries.clear();
+  while(pos < text.size()) {
+    const size_t eol = text.find('\n', pos);
+    e.line.assign(text, pos, eol - pos);
+    pos = eol + 1;
+    e.rest = e.line.find('&');
+    if(e.rest == string::npos)
+      e.rest = e.line.size();
+    e.name = urldecode(e.line, 5, e.rest);
+    if(e.name.compare(0, 2, "./") == 0)
+      e.name.erase(0, 2);
+    else {
+      const string::size_type n = e.name.rfind('/');
+      if(n != string::npos)
+        e.name.erase(0, n + 1);
+    }
+    entries.push_back(e);
+  }
+}
+
+class IndexDiff {
+private:
+  unsigned long long added, removed, changed;
+
+public:
+  inline IndexDiff(): added(0), removed(0), changed(0) {}
+  void diff(File *a, File *b);
+  void report();
+
+private:
+  void block(const string &dir, const string &atext, const string &btext);
+  void output(const char *what, const string &dir, const DiffEntry &e,
+              const string &why = "");
+  void compare(const string &dir, const DiffEntry &a, const DiffEntry &b);
+};
+
+void IndexDiff::output(const char *what, const string &dir,
+                       const DiffEntry &e, const string &why) {
+  const string path = dir == "" ? e.name : dir + "/" + e.name;
+
+  if(printf("%s %s%s\n", what, path.c_str(), why.c_str()) < 0)
+    fatal("error writing to stdout: %s", strerror(errno));
+}
+
+// Compare two entries with the same name
+void IndexDiff::compare(const string &dir,
+                        const DiffEntry &a, const DiffEntry &b) {
+  map<string,string> adetails, bdetails;
+  string why;
+
+  if(a.line.compare(a.rest, string::npos, b.line, b.rest, string::npos) == 0)
+    return;
+  parseIndexLine(a.line, adetails);
+  parseIndexLine(b.line, bdetails);
+  // Both maps are sorted, so merge them to find the keys that differ
+  map<string,string>::const_iterator ait = adetails.begin(),
+    bit = bdetails.begin();
+  while(ait != adetails.end() || bit != bdetails.end()) {
+    const string *key;
+    if(bit == bdetails.end()
+       || (ait != adetails.end() && ait->first < bit->first))
+      key = &(ait++)->first;
+    else if(ait == adetails.end() || bit->first < ait->first)
+      key = &(bit++)->first;
+    else {
+      key = &ait->first;
+      const bool same = ait->second == bit->second;
+      ++ait;
+      ++bit;
+      if(same)
+        continue;
+    }
+    if(ignored_detail(*key))
+      continue;
+    why += why.empty() ? " (" : ", ";
+    why += *key;
+  }
+  if(why.empty())
+    return;
+  why += ")";
+  output("changed", dir, b, why);
+  ++changed;
+}
+
+// Compare the entries for one directory.  Either text may be empty, if the
+// directory is only present in one index.
+void IndexDiff::block(const string &dir,
+                      const string &atext, const string &btext) {
+  vector<DiffEntry> a, b;
+  size_t i = 0, j = 0;
+
+  if(atext == btext)
+    return;
+  split_block(atext, a);
+  split_block(btext, b);
+  while(i < a.size() || j < b.size()) {
+    int c;
+    if(i == a.size())
+      c = 1;
+    else if(j == b.size())
+      c = -1;
+    else
+      c = a[i].name.compare(b[j].name);
+    if(c < 0) {
+      output("removed", dir, a[i++]);
+      ++removed;
+    } else if(c > 0) {
+      output("added", dir, b[j++]);
+      ++added;
+    } else
+      compare(dir, a[i++], b[j++]);
+  }
+}
+
+void IndexDiff::diff(File *a, File *b) {
+  IndexBlockReader ablocks(a), bblocks(b);
+  string adir, atext, bdir, btext;
+  const string empty;
+
+  bool amore = ablocks.next(adir, atext), bmore = bblocks.next(bdir, btext);
+  while(amore || bmore) {
+    int c;
+    if(!amore)
+      c = 1;
+    else if(!bmore)
+      c = -1;
+    else
+      c = compare_dirs(adir, bdir);
+    if(c < 0) {
+      block(adir, atext, empty);
+      amore = ablocks.next(adir, atext);
+    } else if(c > 0) {
+      block(bdir, empty, btext);
+      bmore = bblocks.next(bdir, btext);
+    } else {
+      block(adir, atext, btext);
+      amore = ablocks.next(adir, atext);
+      bmore = bblocks.next(bdir, btext);
+    }
+  }
+}
+
+void IndexDiff::report() {
+  fprintf(stderr,
+          "Added:                %8llu\n"
+          "Removed:              %8llu\n"
+          "Changed:              %8llu\n",
+          added, removed, changed);
+}
+
+// Report the differences between the two indexes in ARGV
+void do_diff(int argc, char **argv) {
+  if(argc != 2) fatal("--diff-index requires two index files");
+  File *a = openindex(backupfs, argv[0]), *b = 0;
+  IndexDiff d;
+
+  try {
+    b = openindex(backupfs, argv[1]);
+    d.diff(a, b);
+  } catch(...) {
+    delete a;
+    if(b) delete b;
+    throw;
+  }
+  delete a;
+  delete b;
+  if(verbose)
+    d.report();
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -67,6 +67,23 @@ const char *BadIndexFile::what() const throw() {
   return w;
 }
 
+FileChanged::FileChanged(const string &path) {
+  snprintf(w, sizeof w, "%s changed hash between test and write",
+           path.c_str());
+}
+
+const char *FileChanged::what() const throw() {
+  return w;
+}
+
+CompressionError::CompressionError(const string &path, const char *message) {
+  snprintf(w, sizeof w, "%s: %s", path.c_str(), message);
+}
+
+const char *CompressionError::what() const throw() { 
+  return w;
+}
+
 /*
 Local Variables:
 c-basic-offset:2
@@ -21,9 +21,11 @@
 
 int File::fill() {
   assert(mode != writing);
+  if(!buffer)
+    allocate();
   mode = reading;
   if(!eof) {
-    int n = readbytes(buffer, sizeof buffer);
+    int n = readbytes(buffer, buffersize);
     next = buffer;
     top = buffer + n;
     if(!n) eof = true;
@@ -37,6 +39,26 @@ File::~File() {
   // so it is too late to flush.
   if(mode == writing) 
     assert(next == buffer);
+  free(buffer);
+}
+
+void File::allocate() {
+  const size_t pagesize = sysconf(_SC_PAGESIZE);
+  void *p;
+  int rc;
+
+  buffersize = preferred_iosize();
+  buffersize = (buffersize + pagesize - 1) / pagesize * pagesize;
+  if(!buffersize)
+    buffersize = pagesize;
+  if((rc = posix_memalign(&p, pagesize, buffersize)))
+    fatal("error allocating %lu bytes: %s",
+          (unsigned long)buffersize, strerror(rc));
+  buffer = (unsigned char *)p;
+}
+
+size_t File::preferred_iosize() const {
+  return io_size ? io_size : DEFAULT_IO_SIZE;
 }
   
 int File::readbytes(void */*buf*/, int /*space*/) {
@@ -51,12 +73,20 @@ void File::synchronize() {
 }
 
 int File::getline(string &r) {
-  int c;
-  
   r.clear();
-  while((c = getch()) != '\n' && c != EOF)
-    r += (char)c;
-  return c != EOF || r.size() != 0;
+  for(;;) {
+    if(next == top && !fill())
+      return r.size() != 0;
+    const unsigned char *nl = (const unsigned char *)memchr(next, '\n',
+                                                            top - next);
+    if(nl) {
+      r.append((const char *)next, nl - next);
+      next = (unsigned char *)nl + 1;
+      return 1;
+    }
+    r.append((const char *)next, top - next);
+    next = top;
+  }
 }
 
 int File::getbytes(void *dst, int max, bool all) {
@@ -65,7 +95,7 @@ int File::getbytes(void *dst, int max, bool all) {
       return 0;
   int total = 0;
   do {
-    if(next == top && max < (int)sizeof buffer && !eof) {
+    if(next == top && (size_t)max < buffersize && !eof) {
       // The buffer is empty, and we're doing a small read.  Arrange for the
       // buffer not to be empty.
       if(!fill())
@@ -102,10 +132,43 @@ int File::getbytes(string &s, int n, bool all) {
   return n;
 } 
 
+bool File::fastcopy(File */*src*/) {
+  return false;
+}
+
+bool File::clone(File */*src*/) {
+  return false;
+}
+
+void File::copyto(File *dst, Hash *hash) {
+  if(dst && !hash && dst->fastcopy(this))
+    return;
+  while(next != top || fill()) {
+    if(dst)
+      dst->put((const char *)next, top - next);
+    if(hash)
+      hash->write(next, top - next);
+    next = top;
+  }
+}
+
 void File::put(const char *s, size_t len) {
-  // Not very efficient, but simple
-  while(len-- > 0)
-    put(*s++);
+  while(len > 0) {
+    if(next == top)
+      flush();
+    size_t n;
+    if(next == buffer && len >= buffersize) {
+      // bypass buffering for large writes
+      n = buffersize;
+      writebytes(s, n);
+    } else {
+      n = (size_t)(top - next) < len ? top - next : len;
+      memcpy(next, s, n);
+      next += n;
+    }
+    s += n;
+    len -= n;
+  }
 }
 
 void File::putf(const char *fmt, ...) {
@@ -126,18 +189,100 @@ void File::putf(const char *fmt, ...) {
   free(s);
 }
 
+void File::putu(unsigned long long n) {
+  char digits[24], *ptr = digits + sizeof digits;
+
+  do {
+    *--ptr = '0' + n % 10;
+    n /= 10;
+  } while(n);
+  put(ptr, digits + sizeof digits - ptr);
+}
+
+void File::putd(long long n) {
+  if(n < 0) {
+    put('-');
+    putu(-(unsigned long long)n);
+  } else
+    putu(n);
+}
+
+void File::putoctal(unsigned long n) {
+  char digits[24], *ptr = digits + sizeof digits;
+
+  do {
+    *--ptr = '0' + (n & 7);
+    n >>= 3;
+  } while(n);
+  if(*ptr != '0')
+    *--ptr = '0';
+  put(ptr, digits + sizeof digits - ptr);
+}
+
+void File::puturl(const char *s, size_t len) {
+  while(len > 0) {
+    size_t n = (top - next) / 3;
+    if(!n) {
+      flush();
+      continue;
+    }
+    if(n > len)
+      n = len;
+    next = (unsigned char *)urlencode((char *)next, s, n);
+    s += n;
+    len -= n;
+  }
+}
+
+void File::puthex(const uint8_t *h, size_t len) {
+  while(len > 0) {
+    size_t n = (top - next) / 2;
+    if(!n) {
+      flush();
+      continue;
+    }
+    if(n > len)
+      n = len;
+    next = (unsigned char *)hexencode((char *)next, h, n);
+    h += n;
+    len -= n;
+  }
+}
+
 void File::flush() {
   assert(mode != reading);
   if(mode == writing) {
     if(next != buffer)
       writebytes(buffer, next - buffer);
-  } else
+  } else {
+    if(!buffer)
+      allocate();
     mode = writing;
+  }
   next = buffer;
-  top = buffer + sizeof buffer;
+  top = buffer + buffersize;
   synchronize();
 }
 
+void File::discard() {
+  if(mode == writing)
+    next = buffer;
+}
+
+void File::finish() {
+  flush();
+}
+
+void File::boundary(const string &/*dir*/) {
+}
+
+bool File::lookingat(const void *bytes, int n) {
+  assert(mode != writing);
+  if(next == top && !fill())
+    return false;
+  return top - next >= n && !memcmp(next, bytes, n);
+}
+
 void Filesystem::link(const string &path, const string &) {
   throw FileError("linking", path, ENOSYS);
 }
@@ -162,6 +307,14 @@ void Filesystem::utimes(const string &path, time_t, time_t) {
   throw FileError("setting file times", path, ENOSYS);
 }
 
+void Filesystem::fsync(const string &path, bool) {
+  throw FileError("syncing", path, ENOSYS);
+}
+
+void Filesystem::syncfs(const string &path) {
+  throw FileError("syncing filesystem containing", path, ENOSYS);
+}
+
 string Filesystem::readlink(const string &path) {
   throw FileError("reading symlink", path, ENOSYS);
 }
@@ -178,10 +331,42 @@ void Filesystem::makedirs(const string &path) {
     if(path[n] == '/') {
       string prefix(path, 0, n);
       if(!exists(prefix))
-	mkdir(path.substr(0, n));
+	mkdir_exists_ok(prefix);
+    }
+  }
+  mkdir_exists_ok(path);
+}
+
+void Filesystem::mkdirs(const list<string> &paths) {
+  for(list<string>::const_iterator it = paths.begin();
+      it != paths.end();
+      ++it)
+    mkdir_exists_ok(*it);
+}
+
+void Filesystem::removes(const list<string> &paths) {
+  for(list<string>::const_iterator it = paths.begin();
+      it != paths.end();
+      ++it) {
+    try {
+      remove(*it);
+    } catch(FileError &e) {
+      error("%s", e.what());
     }
   }
-  mkdir(path);
+}
+
+// Create PATH, unless someone else gets there first
+void Filesystem::mkdir_exists_ok(const string &path) {
+  try {
+    mkdir(path);
+  } catch(FileError &e) {
+    if(e.error() != EEXIST || !exists(path)) throw;
+    // A symlink to a directory will do, so follow links, unlike type()
+    DirEntry d;
+    attributes(path, d);
+    if(d.type != Directory) throw;
+  }
 }
 
 /*
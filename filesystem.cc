@@ -21,9 +21,40 @@
 
 Filesystem::~Filesystem() {}
 
+void Filesystem::init() {
+}
+
 void Filesystem::prefigure_exists(const string &/*path*/) {
 }
 
+void Filesystem::prefetch(const string &/*path*/) {
+}
+
+void Filesystem::uncache(const string &/*path*/) {
+}
+
+bool Filesystem::checkfile(const string &/*path*/, uint8_t /*h*/[HASH_SIZE]) {
+  return false;
+}
+
+void Filesystem::prefigure_checkfile(const string &/*path*/) {
+}
+
+bool Filesystem::install(const string &/*path*/, File */*src*/,
+                         const uint8_t */*hash*/) {
+  return false;
+}
+
+void Filesystem::finish_installs() {
+}
+
+Filetype filetype(mode_t mode) {
+  if(S_ISREG(mode)) return RegularFile;
+  else if(S_ISDIR(mode)) return Directory;
+  else if(S_ISLNK(mode)) return SymbolicLink;
+  else return UnknownFileType;
+}
+
 /*
 Local Variables:
 c-basic-offset:2
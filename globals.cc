@@ -27,8 +27,12 @@ unsigned long long unknown_files;
 unsigned long long new_hashes;
 unsigned long long hash_mmap;
 unsigned long long hash_read;
+unsigned long long hash_remote;
 unsigned long long small_files;
 unsigned long long hints_used;
+unsigned long long reused_dirs;
+unsigned long long fast_copies;
+unsigned long long sync_batches;
 
 unsigned long long errors;       // error count
 unsigned long long warnings;     // warning count
@@ -36,12 +40,23 @@ unsigned long long warnings;     // warning count
 string repo, indexfile, root, sftphost;
 int crossfs = 1, preserve_atime, overwrite_index, deleteclean, verbose;
 int permissions = 1;
+int jobs;
 bool detectbogus;
 Exclusions exclusions;
 const char *sftpserver;
+const char *remoteagent;
 bool recheckhash = true;
+bool syncrepo;
+bool dropcache;
+bool compressindex;
+string baseindex;
+size_t io_size;
+int sftp_writes = SFTP_WRITE_WINDOW;
+int sftp_connections = 1;
+RestoreMethod restoremethod = RestoreCopy;
 
 Filesystem *hostfs = &local, *backupfs = &local;
+vector<Filesystem *> reposessions;
 const char *from_encoding, *to_encoding;
 
 string hintfile;
@@ -93,10 +93,9 @@ bool HashSet::has(const uint8_t h[HASH_SIZE]) const {
 void hashfile(Filesystem *fs, const string &path, uint8_t h[HASH_SIZE],
               bool mmap_hint) {
   Hash ho;
-  char buffer[4096];
 
   if(fs == &local && mmap_hint) {
-    int fd = open(path.c_str(), O_RDONLY);
+    int fd = LocalFile::open_readonly(path);
     struct stat sb;
     void *m = 0;
     off_t n, size = 0;
@@ -122,20 +121,23 @@ void hashfile(Filesystem *fs, const string &path, uint8_t h[HASH_SIZE],
       throw;
     }
     if(close(fd) < 0) throw FileError("closing", path, errno);
-    ++hash_mmap;
+    count(hash_mmap);
   } else {
+    // Remote filesystems may be able to hash the file without sending it
+    if(fs->checkfile(path, h)) {
+      count(hash_remote);
+      return;
+    }
     File *f = fs->open(path, ReadOnly);
-    int n;
 
     try {
-      while((n = f->getbytes(buffer, sizeof buffer, false)))
-        ho.write(buffer, n);
+      f->copyto(0, &ho);
     } catch(...) {
       delete f;
       throw;
     }
     delete f;
-    ++hash_read;
+    count(hash_read);
   }
   memcpy(h, ho.value(), HASH_SIZE);
 }
@@ -18,6 +18,13 @@
  * USA
  */
 #include "nhbackup.h"
+#include <sys/ioctl.h>
+#if HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+#if HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
 
 // Local Filesystem -----------------------------------------------------------
 
@@ -33,10 +40,36 @@ LocalFile::LocalFile(const string &path_, OpenMode mode) :
   case NoOverwrite: m = O_WRONLY|O_CREAT|O_EXCL; break;
   default: fatal("invalid open mode %d", (int)mode);
   }
-  if((fd = open(path_.c_str(), m, 0666)) < 0)
+  if(mode == ReadOnly)
+    fd = open_readonly(path_);
+  else
+    fd = open(path_.c_str(), m, 0666);
+  if(fd < 0)
     throw FileError("opening", path, errno);
 }
 
+int LocalFile::open_readonly(const string &path) {
+  int fd = -1;
+
+#ifdef O_NOATIME
+  // Only the file's owner (or root) may use O_NOATIME.  Anyone else gets an
+  // ordinary open and the caller must put the access time back itself.
+  if(preserve_atime) {
+    fd = open(path.c_str(), O_RDONLY|O_NOATIME);
+    if(fd < 0 && errno != EPERM)
+      return -1;
+  }
+#endif
+  if(fd < 0)
+    fd = open(path.c_str(), O_RDONLY);
+#if HAVE_POSIX_FADVISE
+  // Everything we read, we read from start to finish
+  if(fd >= 0)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  return fd;
+}
+
 LocalFile::~LocalFile() {
   if(fd != -1 && close(fd) < 0) throw FileError("closing", path, errno);
 }
@@ -51,12 +84,84 @@ void LocalFile::writebytes(const void *buf, int nbytes) {
   int n, written = 0;
   
   while(written < nbytes) {
-    if((n = write(fd, (const char *)buf + written, nbytes)) < 0)
+    if((n = write(fd, (const char *)buf + written, nbytes - written)) < 0)
       throw FileError("writing", path, errno);
     written += n;
   }
 }
 
+// Errors meaning a fast copy method doesn't apply to these files
+static bool unsupported(int e) {
+  return e == EXDEV || e == EINVAL || e == ENOSYS || e == EOPNOTSUPP
+    || e == ENOTTY || e == EBADF || e == EPERM;
+}
+
+bool LocalFile::clone(File *src_) {
+  LocalFile *const src = dynamic_cast<LocalFile *>(src_);
+
+  if(!src || mode != none || src->mode != none)
+    return false;
+#ifdef FICLONE
+  // Share the source's blocks, if the filesystem supports it (btrfs, XFS)
+  if(ioctl(fd, FICLONE, src->fd) == 0) {
+    src->mode = reading;                // leave SRC at end of file
+    src->eof = true;
+    count(fast_copies);
+    return true;
+  }
+  if(!unsupported(errno))
+    throw FileError("cloning", path, errno);
+#endif
+  return false;
+}
+
+bool LocalFile::fastcopy(File *src_) {
+  LocalFile *const src = dynamic_cast<LocalFile *>(src_);
+
+  // Both files must be untouched, so there's nothing in their buffers
+  if(!src || mode != none || src->mode != none)
+    return false;
+  if(clone(src))
+    return true;
+  bool copied = false;
+#if HAVE_COPY_FILE_RANGE
+  // Copy in the kernel, which can still share blocks on some filesystems
+  if(!copied) {
+    bool started = false;
+    ssize_t n;
+    while((n = copy_file_range(src->fd, 0, fd, 0, 1 << 30, 0)) > 0)
+      started = true;
+    if(n == 0)
+      copied = true;
+    else if(started || !unsupported(errno))
+      throw FileError("copying to", path, errno);
+  }
+#endif
+#if HAVE_SYS_SENDFILE_H
+  if(!copied) {
+    bool started = false;
+    ssize_t n;
+    while((n = sendfile(fd, src->fd, 0, 1 << 30)) > 0)
+      started = true;
+    if(n == 0)
+      copied = true;
+    else if(started || !unsupported(errno))
+      throw FileError("copying to", path, errno);
+  }
+#endif
+  if(!copied)
+    return false;
+  // Leave SRC at end of file
+  src->mode = reading;
+  src->eof = true;
+  count(fast_copies);
+  return true;
+}
+
+size_t LocalFile::preferred_iosize() const {
+  return io_size ? io_size : LOCAL_IO_SIZE;
+}
+
 bool LocalFile::readable() const {
   fd_set fds;
   assert(mode != writing);
@@ -162,6 +267,43 @@ void LocalFilesystem::contents(const string &path,
   if(closedir(dp) < 0) throw FileError("closing directory", path, errno);
 }
 
+void LocalFilesystem::scan(const string &path,
+                           list<DirEntry> &c) {
+  DIR *dp;
+  struct dirent *de;
+  struct stat sb;
+
+  c.clear();
+  if(!(dp = opendir(path.c_str())))
+    throw FileError("opening directory", path, errno);
+  try {
+    errno = 0;
+    while((de = readdir(dp))) {
+      const string name = de->d_name;
+      if(name != "." && name != "..") {
+        if(fstatat(dirfd(dp), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+          // it might have been deleted since readdir() saw it
+          if(errno != ENOENT)
+            throw FileError("lstat", path + "/" + name, errno);
+        } else {
+          c.push_back(DirEntry());
+          DirEntry &e = c.back();
+          e.name = name;
+          e.type = filetype(sb.st_mode);
+          e.size = sb.st_size;
+          e.mtime = sb.st_mtime;
+        }
+      }
+      errno = 0;
+    }
+    if(errno) throw FileError("reading directory", path, errno);
+  } catch(...) {
+    closedir(dp);
+    throw;
+  }
+  if(closedir(dp) < 0) throw FileError("closing directory", path, errno);
+}
+
 string LocalFilesystem::readlink(const string &path) {
   char buffer[MAXLINKSIZE];
 
@@ -189,10 +331,78 @@ Filetype LocalFilesystem::type(const string &path) {
 
   if(lstat(path.c_str(), &sb) < 0)
     throw FileError("lstat", path, errno);
-  if(S_ISREG(sb.st_mode)) return RegularFile;
-  else if(S_ISDIR(sb.st_mode)) return Directory;
-  else if(S_ISLNK(sb.st_mode)) return SymbolicLink;
-  else return UnknownFileType;
+  return filetype(sb.st_mode);
+}
+
+void LocalFilesystem::attributes(const string &path, DirEntry &e) {
+  struct stat sb;
+
+  if(::stat(path.c_str(), &sb) < 0)
+    throw FileError("stat", path, errno);
+  e.type = filetype(sb.st_mode);
+  e.size = sb.st_size;
+  e.mtime = sb.st_mtime;
+}
+
+void LocalFilesystem::fsync(const string &path, bool dataonly) {
+  int fd, rc;
+
+  // Directories can only be opened read-only, and that's enough to sync
+  // them
+  if((fd = ::open(path.c_str(), O_RDONLY)) < 0)
+    throw FileError("opening", path, errno);
+  rc = dataonly ? ::fdatasync(fd) : ::fsync(fd);
+  const int save_errno = errno;
+  ::close(fd);
+  if(rc < 0)
+    throw FileError("syncing", path, save_errno);
+}
+
+// Both of these are only hints, so errors are ignored
+
+void LocalFilesystem::prefetch(const string &path) {
+#if HAVE_POSIX_FADVISE
+  const int fd = LocalFile::open_readonly(path);
+
+  if(fd >= 0) {
+    posix_fadvise(fd, 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+    ::close(fd);
+  }
+#endif
+}
+
+void LocalFilesystem::uncache(const string &path) {
+#if HAVE_POSIX_FADVISE
+  const int fd = LocalFile::open_readonly(path);
+
+  if(fd >= 0) {
+# if HAVE_SYNC_FILE_RANGE
+    // Dirty pages can't be dropped, so write them out first
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE
+                    |SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+# endif
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+  }
+#endif
+}
+
+void LocalFilesystem::syncfs(const string &path) {
+#if HAVE_SYNCFS
+  int fd, rc;
+
+  if((fd = ::open(path.c_str(), O_RDONLY)) < 0)
+    throw FileError("opening", path, errno);
+  rc = ::syncfs(fd);
+  const int save_errno = errno;
+  ::close(fd);
+  if(rc < 0)
+    throw FileError("syncing filesystem containing", path, save_errno);
+#else
+  // sync() makes no promise to wait for the writes to complete, so the
+  // caller must fall back to syncing files individually
+  throw FileError("syncing filesystem containing", path, ENOSYS);
+#endif
 }
 
 /*
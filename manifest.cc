@@ -0,0 +1,194 @@
+/*
+ * This file is part of hbackup.
+ * Copyright (C) 2009 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+#include "nhbackup.h"
+
+/* A hash manifest lists the hashes an index refers to, so that cleanup
+ * doesn't have to parse the index itself.  It lives next to the index, with
+ * MANIFEST_SUFFIX appended to its name.  The format is:
+ *
+ *   8 bytes     "hbhashv2"
+ *   8 bytes     size of the index, big-endian
+ *   8 bytes     mtime of the index, big-endian
+ *   8 bytes     number of hashes, big-endian
+ *   N*20 bytes  the hashes, sorted and without duplicates
+ *   20 bytes    SHA1 of everything before it
+ *
+ * The size and mtime identify the index the manifest was made from.  If the
+ * index has been rewritten since, they won't match and the manifest is
+ * ignored.
+ *
+ * Earlier versions wrote "hbhashes" manifests, without the size and mtime.
+ * They are still recognized as manifests but never trusted.
+ */
+
+// Hash Manifests -------------------------------------------------------------
+
+static const char manifest_magic[8] = {
+  'h', 'b', 'h', 'a', 's', 'h', 'v', '2'
+};
+
+static const char old_manifest_magic[8] = {
+  'h', 'b', 'h', 'a', 's', 'h', 'e', 's'
+};
+
+static void pack_uint64(uint8_t *p, uint64_t n) {
+  for(int i = 0; i < 8; ++i)
+    p[i] = (uint8_t)(n >> (56 - 8 * i));
+}
+
+static uint64_t unpack_uint64(const uint8_t *p) {
+  uint64_t n = 0;
+  for(int i = 0; i < 8; ++i)
+    n = (n << 8) + p[i];
+  return n;
+}
+
+// Fill in the part of a manifest header that identifies INDEXPATH
+static void index_identity(Filesystem *fs, const string &indexpath,
+                           uint8_t header[32]) {
+  DirEntry e;
+
+  fs->attributes(indexpath, e);
+  memcpy(header, manifest_magic, sizeof manifest_magic);
+  pack_uint64(header + 8, e.size);
+  pack_uint64(header + 16, (uint64_t)e.mtime);
+}
+
+void write_manifest(Filesystem *fs, const string &indexpath,
+                    vector<HashValue> &hashes) {
+  const string path = indexpath + MANIFEST_SUFFIX, tmp = path + ".tmp";
+  Hash checksum;
+  uint8_t header[32];
+
+  sort(hashes.begin(), hashes.end());
+  hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+  index_identity(fs, indexpath, header);
+  pack_uint64(header + 24, hashes.size());
+  File *f = fs->open(tmp, Overwrite);
+  try {
+    f->put((const char *)header, sizeof header);
+    checksum.write(header, sizeof header);
+    for(vector<HashValue>::const_iterator it = hashes.begin();
+        it != hashes.end();
+        ++it) {
+      f->put((const char *)it->h, HASH_SIZE);
+      checksum.write(it->h, HASH_SIZE);
+    }
+    f->put((const char *)checksum.value(), HASH_SIZE);
+    f->finish();
+  } catch(...) {
+    delete f;
+    throw;
+  }
+  delete f;
+  fs->rename(tmp, path);
+}
+
+bool is_manifest(Filesystem *fs, const string &path) {
+  const size_t l = strlen(MANIFEST_SUFFIX);
+
+  if(path.size() < l || path.compare(path.size() - l, l, MANIFEST_SUFFIX))
+    return false;
+  File *f = fs->open(path, ReadOnly);
+  bool r;
+  try {
+    r = (f->lookingat(manifest_magic, sizeof manifest_magic)
+         || f->lookingat(old_manifest_magic, sizeof old_manifest_magic));
+  } catch(...) {
+    delete f;
+    throw;
+  }
+  delete f;
+  return r;
+}
+
+int read_manifest(Filesystem *fs, const string &indexpath,
+                  vector<HashValue> &hashes) {
+  const string path = indexpath + MANIFEST_SUFFIX;
+  File *f;
+  Hash checksum;
+  uint8_t header[32], identity[32], expected[HASH_SIZE];
+
+  try {
+    f = fs->open(path, ReadOnly);
+  } catch(FileError &e) {
+    if(e.error() != ENOENT)
+      throw;
+    return 0;
+  }
+  hashes.clear();
+  try {
+    const int got = f->getbytes(header, sizeof header);
+    if(got >= (int)sizeof old_manifest_magic
+       && !memcmp(header, old_manifest_magic, sizeof old_manifest_magic)) {
+      // Can't tell what index this was made from
+      delete f;
+      return 0;
+    }
+    if(got < (int)sizeof manifest_magic
+       || memcmp(header, manifest_magic, sizeof manifest_magic)) {
+      warning("%s: not a hash manifest", path.c_str());
+      delete f;
+      return 0;
+    }
+    if(got != sizeof header) {
+      warning("%s: corrupt hash manifest", path.c_str());
+      delete f;
+      return 0;
+    }
+    // If the index has changed since the manifest was written, then the
+    // manifest is out of date
+    index_identity(fs, indexpath, identity);
+    if(memcmp(header, identity, 24)) {
+      delete f;
+      return 0;
+    }
+    checksum.write(header, sizeof header);
+    uint64_t n = unpack_uint64(header + 24);
+    HashValue v;
+    while(n > 0 && f->getbytes(v.h, HASH_SIZE) == HASH_SIZE) {
+      checksum.write(v.h, HASH_SIZE);
+      hashes.push_back(v);
+      --n;
+    }
+    if(n
+       || f->getbytes(expected, HASH_SIZE) != HASH_SIZE
+       || memcmp(expected, checksum.value(), HASH_SIZE)) {
+      warning("%s: corrupt hash manifest", path.c_str());
+      hashes.clear();
+      delete f;
+      return 0;
+    }
+  } catch(...) {
+    delete f;
+    throw;
+  }
+  delete f;
+  return 1;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
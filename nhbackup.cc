@@ -45,6 +45,22 @@ static const struct option longopts[] = {
   { "verbose", no_argument, 0, 'v' },
   { "no-recheck-hash", no_argument, 0, 257 },
   { "hint-file", required_argument, 0, 'H' },
+  { "compress-index", no_argument, 0, 258 },
+  { "base-index", required_argument, 0, 259 },
+  { "compact-index", no_argument, 0, 260 },
+  { "diff-index", no_argument, 0, 261 },
+  { "jobs", required_argument, 0, 'j' },
+  { "io-size", required_argument, 0, 262 },
+  { "reflink", no_argument, 0, 263 },
+  { "hardlink", no_argument, 0, 264 },
+  { "sync", no_argument, 0, 265 },
+  { "drop-cache", no_argument, 0, 266 },
+  { "sftp-writes", required_argument, 0, 267 },
+  { "init-repo", no_argument, 0, 268 },
+  { "sftp-connections", required_argument, 0, 269 },
+  { "remote-agent", required_argument, 0, 270 },
+  { "agent", no_argument, 0, 271 },
+  { "verify-all", no_argument, 0, 272 },
   { "version", no_argument, 0, 'V' },
   { "help", no_argument, 0, 'h' },
   { 0, 0, 0, 0 }
@@ -55,12 +71,22 @@ static const struct option longopts[] = {
 // Display usage message
 static void help() {
   if(printf("nhbackup --backup|--restore|--verify OPTIONS\n"
+            "nhbackup --verify-all OPTIONS\n"
             "nhbackup --cleanup OPTIONS INDEXES...\n"
+            "nhbackup --compact-index OPTIONS\n"
+            "nhbackup --init-repo OPTIONS\n"
+            "nhbackup --diff-index OPTIONS INDEX INDEX\n"
+            "nhbackup --agent\n"
             "\n"
             "  -b, --backup           Save from ROOT to REPO/INDEX\n"
             "  -r, --restore          Restore from REPO/INDEX to ROOT\n"
             "  -c, --verify           Verify REPO/INDEX\n"
+            "  --verify-all           Verify every object in REPO\n"
             "  -C, --cleanup          Cleanup REPO against INDEXES\n"
+            "  --compact-index        Rewrite INDEX as a full index\n"
+            "  --init-repo            Create REPO's directories in advance\n"
+            "  --diff-index           List changes between two indexes\n"
+            "  --agent                Serve a repository to --remote-agent\n"
             "  -R, --repo REPO        Specify repository\n"
             "  -I, --index INDEX      Specify index\n"
             "  -F, --root ROOT        Specify root\n"
@@ -70,13 +96,24 @@ static void help() {
             "  -O, --overwrite        Overwrite index (--backup)\n"
             "  -s, --sftp USER@HOST   Repository is over sftp\n"
             "  -S, --sftp-server PATH  Path to remove SFTP server\n"
+            "  --sftp-writes N        Keep N SFTP writes in flight per file\n"
+            "  --sftp-connections N   Use N SFTP connections in all\n"
+            "  --remote-agent PATH    Run PATH --agent instead of SFTP server\n"
             "  -d, --delete           Delete obsolete files (--cleanup)\n"
+            "  -j, --jobs N           Use N threads (--cleanup, --backup)\n"
+            "  --io-size BYTES        Set file buffer size\n"
+            "  --drop-cache           Don't leave file data in memory\n"
             "  -B, --detect-bogus     Detect bogus files\n"
             "  -P, --no-permissions   Don't restore permissions (--restore)\n"
+            "  --reflink              Clone files from REPO (--restore)\n"
+            "  --hardlink             Link files to REPO (--restore)\n"
             "  -f, --from-encoding ENCODING\n"
             "  -t, --to-encoding ENCODING\n"
             "                         Convert filenames (--restore)\n"
             "  -H, -hint-file PATH    Load/save hints (--backup)\n"
+            "  --compress-index       Compress index (--backup)\n"
+            "  --base-index PATH      Only record changes since PATH (--backup)\n"
+            "  --sync                 Make new data durable (--backup)\n"
             "  -v, --verbose          Verbose mode\n"
             "  -h, --help             Display usage message\n"
             "  -V, --version          Display version string\n") < 0)
@@ -92,13 +129,14 @@ static void display_version() {
 int main(int argc, char **argv) {
   int n;
   int backup = 0, restore = 0, verify = 0, clean = 0, speedtest = 0;
+  int compact = 0, diff = 0, initrepo = 0, agent = 0, verifyall = 0;
 
   // Assumption checking
   assert('0' == 48);
   assert('a' == 97);
   assert('A' == 65);
   assert(UCHAR_MAX == 255);
-  while((n = getopt_long(argc, argv, "brcCR:I:F:xaX:Os:vhBSVzPf:t:H:",
+  while((n = getopt_long(argc, argv, "brcCR:I:F:xaX:Os:vhBSVzPf:t:H:j:",
                          longopts, 0))
         >= 0) {
     switch(n) {
@@ -126,15 +164,74 @@ int main(int argc, char **argv) {
     case 'h': help(); exit(0);
     case 'V': display_version(); exit(0);
     case 257: recheckhash = false; break;
+    case 258:
+#if HAVE_ZSTD
+      compressindex = true;
+      break;
+#else
+      fatal("--compress-index not supported in this build");
+#endif
+    case 259: baseindex = optarg; break;
+    case 260: compact = 1; break;
+    case 261: diff = 1; break;
+    case 262: {
+      char *end;
+      errno = 0;
+      io_size = strtoul(optarg, &end, 10);
+      if(*end == 'k' || *end == 'K') {
+        io_size *= 1024;
+        ++end;
+      } else if(*end == 'm' || *end == 'M') {
+        io_size *= 1024 * 1024;
+        ++end;
+      }
+      if(errno || *end || end == optarg || io_size == 0
+         || io_size > INT_MAX)
+        fatal("invalid --io-size value '%s'", optarg);
+      break;
+    }
+    case 'j':
+      if((jobs = atoi(optarg)) <= 0)
+        fatal("invalid --jobs value '%s'", optarg);
+      break;
+    case 263: restoremethod = RestoreReflink; break;
+    case 264: restoremethod = RestoreHardlink; break;
+    case 265: syncrepo = true; break;
+    case 266: dropcache = true; break;
+    case 267:
+      if((sftp_writes = atoi(optarg)) <= 0)
+        fatal("invalid --sftp-writes value '%s'", optarg);
+      break;
+    case 268: initrepo = 1; break;
+    case 269:
+      if((sftp_connections = atoi(optarg)) <= 0)
+        fatal("invalid --sftp-connections value '%s'", optarg);
+      break;
+    case 270: remoteagent = optarg; break;
+    case 271: agent = 1; break;
+    case 272: verifyall = 1; break;
     default: exit(-1);
     }
   }
-  if(backup + restore + verify + clean + speedtest != 1)
+  if(backup + restore + verify + verifyall + clean + speedtest + compact
+     + diff + initrepo + agent != 1)
     fatal("inconsistent options");
+  if(restoremethod != RestoreCopy && !restore)
+    fatal("--reflink and --hardlink only apply to --restore");
+  if(syncrepo && !backup)
+    fatal("--sync only applies to --backup");
+  if(remoteagent && sftphost == "")
+    fatal("--remote-agent requires --sftp");
   try {
     signal(SIGPIPE, SIG_IGN);
-    if(sftphost != "")
+    if(sftphost != "") {
       backupfs = new SftpFilesystem(sftphost);
+      // With more than one connection, files are transferred over the extra
+      // ones and backupfs is left for everything else
+      for(int n = 1; n < sftp_connections; ++n)
+        reposessions.push_back(new SftpFilesystem(sftphost));
+    } else if(sftp_connections > 1)
+      fatal("--sftp-connections requires --sftp");
     if(backup) {
       if(from_encoding || to_encoding)
         fatal("encoding translation not supported for backup");
@@ -150,12 +247,17 @@ int main(int argc, char **argv) {
                 "New hashes:           %8llu\n"
                 "Files mapped to hash: %8llu\n"
                 "Files read to hash:   %8llu\n"
+                "Hashed remotely:      %8llu\n"
                 "Tiny files:           %8llu\n"
-                "Hints used:           %8llu\n",
+                "Hints used:           %8llu\n"
+                "Reused directories:   %8llu\n"
+                "Fast copies:          %8llu\n"
+                "Sync batches:         %8llu\n",
                 total_regular_files, total_dirs, total_links, total_devs,
                 total_socks,
-                unknown_files, new_hashes, hash_mmap, hash_read, small_files,
-                hints_used);
+                unknown_files, new_hashes, hash_mmap, hash_read, hash_remote,
+                small_files, hints_used, reused_dirs, fast_copies,
+                sync_batches);
     } else if(restore) {
       do_restore();
       if(verbose)
@@ -166,18 +268,38 @@ int main(int argc, char **argv) {
                 "Devices:              %8llu\n"
                 "Sockets:              %8llu\n"
                 "Tiny files:           %8llu\n"
-                "Hard links:           %8llu\n",
+                "Hard links:           %8llu\n"
+                "Fast copies:          %8llu\n",
                 total_regular_files, total_dirs, total_links, total_devs,
                 total_socks,
-                small_files, total_hardlinks);
-    } else if(verify)
-      do_verify();
-    else if(clean) {
+                small_files, total_hardlinks, fast_copies);
+    } else if(verify || verifyall) {
+      if(verifyall)
+        do_verify_all();
+      else
+        do_verify();
+      if(verbose)
+        fprintf(stderr,
+                "Files read to hash:   %8llu\n"
+                "Hashed remotely:      %8llu\n",
+                hash_read, hash_remote);
+    } else if(clean) {
       if(indexfile != "")
         fatal("--index is not compatible with --clean");
       do_clean(argc - optind, argv + optind);
     } else if(speedtest)
       do_speedtest();
+    else if(compact)
+      do_compact();
+    else if(initrepo)
+      do_init_repo();
+    else if(agent)
+      do_agent();
+    else if(diff) {
+      if(indexfile != "")
+        fatal("--index is not compatible with --diff-index");
+      do_diff(argc - optind, argv + optind);
+    }
   } catch (exception &e) {
     fatal("%s", e.what());
   }
@@ -20,6 +20,10 @@
 #ifndef NHBACKUP_H
 #define NHBACKUP_H
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -35,6 +39,7 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <iconv.h>
+#include <pthread.h>
 #include <cstring>
 #include <climits>
 
@@ -50,6 +55,7 @@
 #include <list>
 #include <map>
 #include <set>
+#include <vector>
 #include <algorithm>
 
 #include "sha1.h"
@@ -69,6 +75,9 @@ using namespace std;
 // of the file.
 #define DEPTH 2
 
+// Length of a path returned by hashpath()
+#define HASHPATH_SIZE (3 * DEPTH + 2 * HASH_SIZE)
+
 
 // These things can be adjusted to taste without worrying about repo
 // compatibility:
@@ -93,6 +102,82 @@ using namespace std;
 // large unless mmap/munmap pairs are comparably expensive to hashing 256Mbyte.
 #define MAXMAP (256 * 1024 * 1024)
 
+// Minimum amount of uncompressed data in each frame of a compressed index.
+// Frames only end at the start of a directory, so they will often be a bit
+// bigger than this.  Smaller frames mean finer-grained seeking but worse
+// compression.
+#define INDEX_FRAME_SIZE (1024 * 1024)
+
+// Compression level for compressed indexes.
+#define INDEX_COMPRESSION_LEVEL 3
+
+// Default buffer size for files.  --io-size overrides this (and the two
+// below).  Buffer sizes are always rounded up to a whole number of pages.
+#define DEFAULT_IO_SIZE 4096
+
+// Buffer size for local files.  Most file copying is big sequential reads and
+// writes, which modern disks only handle efficiently in large chunks.
+#define LOCAL_IO_SIZE (1024 * 1024)
+
+// Size of each READ and WRITE request unless the server's limits@openssh.com
+// reply allows more.  Servers are only obliged to support 32Kbyte reads, and
+// may truncate bigger ones.  SFTP file buffers are one WRITE long; --io-size
+// can make them smaller but not bigger.
+#define SFTP_IO_SIZE 32768
+
+// Largest READ or WRITE request to send, even if the server's
+// limits@openssh.com reply allows more.
+#define SFTP_MAX_REQUEST (1024 * 1024)
+
+// Default number of WRITE requests to have in flight per file (--sftp-writes).
+// Each one carries up to the server's max-write-length bytes, so a single
+// upload streams without waiting for replies until the window is full.
+#define SFTP_WRITE_WINDOW 16
+
+// Number of slots in the SFTP reply table, which is indexed by request ID
+// modulo this (a power of 2).  Requests whose slot is wanted by a newer ID
+// before they complete move to a slower overflow map.
+#define SFTP_REPLY_SLOTS 4096
+
+// Most small requests (such as MKDIR or LSTAT) to have in flight at once when
+// a batch of them is sent together.
+#define SFTP_REQUEST_WINDOW 256
+
+// Most paths to ask nhbackup --agent about in one existence query.  Smaller
+// batches are sent whenever no query is in flight, so on a slow link the
+// batches grow to cover the round trip time.
+#define AGENT_EXISTS_BATCH 4096
+
+// Most data to have in flight in READ requests.  The number of READs in flight
+// starts at SFTP_READ_WINDOW and doubles whenever data doesn't arrive in time,
+// until it covers the link's bandwidth-delay product or reaches this limit.
+#define SFTP_READ_WINDOW 8
+#define SFTP_MAX_READ_WINDOW (16 * 1024 * 1024)
+
+// With --sync, new objects are made durable in batches of up to this many
+// objects or bytes, whichever comes first.  Each batch costs one syncfs() and
+// one fsync() per fan-out directory it touches.
+#define SYNC_BATCH_OBJECTS 1024
+#define SYNC_BATCH_BYTES (256 * 1024 * 1024)
+
+// Number of threads writing new objects into a local repository, unless
+// --jobs says otherwise.  The work is mostly waiting for disks so there's no
+// point tying this to the number of CPUs.
+#define DEFAULT_WRITERS 4
+
+// Maximum number of files waiting for a restore thread.  As above, the restore
+// waits for the threads when it gets this far ahead.
+#define READ_QUEUE_LENGTH 256
+
+// Maximum number of new objects waiting for a writer thread.  The backup
+// stops and waits for the writers when it gets this far ahead.
+#define WRITE_QUEUE_LENGTH 256
+
+// How much of the next file to be hashed to read ahead of time.  Big files are
+// read ahead anyway once hashing starts, so this only needs to cover the
+// start of each file.
+#define PREFETCH_SIZE (1024 * 1024)
+
 // Recording ------------------------------------------------------------------
 
 extern unsigned long long total_regular_files, total_dirs, total_links, total_devs;
@@ -101,8 +186,17 @@ extern unsigned long long unknown_files;
 extern unsigned long long new_hashes;
 extern unsigned long long hash_mmap;
 extern unsigned long long hash_read;
+extern unsigned long long hash_remote;
 extern unsigned long long small_files;
 extern unsigned long long hints_used;
+extern unsigned long long reused_dirs;
+extern unsigned long long fast_copies;
+extern unsigned long long sync_batches;
+
+// Add one to a statistic that several threads might update
+inline void count(unsigned long long &counter) {
+  __sync_fetch_and_add(&counter, 1);
+}
 
 extern unsigned long long errors;       // error count
 extern unsigned long long warnings;     // warning count
@@ -171,8 +265,24 @@ public:
   const char *what() const throw();
 };
 
+class FileChanged: public exception {
+  char w[1024];
+public:
+  FileChanged(const string &path);
+  const char *what() const throw();
+};
+
+class CompressionError: public exception {
+  char w[1024];
+public:
+  CompressionError(const string &path, const char *message);
+  const char *what() const throw();
+};
+
 // Files ----------------------------------------------------------------------
 
+class Hash;
+
 // Generic file
 class File {
 protected:
@@ -183,9 +293,16 @@ protected:
     writing                             // top = end of buffer
   } mode;
   bool eof;
-  unsigned char buffer[4096];
+  unsigned char *buffer;                // page-aligned, allocated on first use
+  size_t buffersize;
 
   int fill();
+
+  void allocate();
+  // Allocate the buffer
+
+  virtual size_t preferred_iosize() const;
+  // Return the buffer size to use for this file.
   
   virtual int readbytes(void *buf, int space);
   // Read up to SPACE bytes.  Return actual number read.
@@ -198,7 +315,8 @@ protected:
   // produce.  Required for efficient remote operation.
 
 public:
-  inline File() : next(0), top(0), mode(none), eof(0) {}
+  inline File() : next(0), top(0), mode(none), eof(0), buffer(0),
+                  buffersize(0) {}
 
   virtual ~File();
 
@@ -218,6 +336,25 @@ public:
   
   // Get (up to) N bytes into a string.  Returns the number of bytes read.
   int getbytes(string &s, int n, bool all=true);
+
+  // Copy the rest of the file to DST and/or feed it to HASH.  Either may be
+  // null.
+  void copyto(File *dst, Hash *hash = 0);
+
+  // Copy the rest of SRC to this file without passing it through either
+  // file's buffer, if the two files' types allow it.  Returns false (having
+  // done nothing) if they don't.
+  virtual bool fastcopy(File *src);
+
+  // Make this file share SRC's data (a reflink), if the filesystem supports
+  // it.  Returns false (having done nothing) if it doesn't.
+  virtual bool clone(File *src);
+
+  // Return the buffer size
+  inline size_t iosize() {
+    if(!buffer) allocate();
+    return buffersize;
+  }
   
   // Write a character
   inline void put(int c) {
@@ -240,9 +377,44 @@ public:
 
   void putf(const char *fmt, ...);
 
+  // Write a number in decimal
+  void putu(unsigned long long n);
+  void putd(long long n);
+
+  // Write a number in octal, with a leading 0 (as printf's %#o)
+  void putoctal(unsigned long n);
+
+  // Write a string, url-encoded
+  void puturl(const char *s, size_t len);
+
+  // Write a string, url-encoded
+  inline void puturl(const string &s) {
+    puturl(s.data(), s.size());
+  }
+
+  // Write bytes in hex
+  void puthex(const uint8_t *h, size_t len);
+
   // Flush pending output.  Write errors might be deferred until a call to
   // flush().
   void flush();
+
+  // Throw away any pending output, for instance because writing it failed
+  void discard();
+
+  // Flush pending output and write any trailing data the format requires.
+  // Call this after the last write, before deleting the file.
+  virtual void finish();
+
+  // Note that the output so far ends just before the start of directory DIR.
+  // Formats that support seeking use this to decide where to put their
+  // synchronization points.
+  virtual void boundary(const string &dir);
+
+  // Return true if the next N bytes to be read are BYTES.  Doesn't consume
+  // anything.  Only looks at the first buffer's worth of the file so N had
+  // better be small.
+  bool lookingat(const void *bytes, int n);
 };
 
 enum Filetype {
@@ -252,6 +424,15 @@ enum Filetype {
   UnknownFileType,
 };
 
+// A directory entry, with the attributes that listing a directory can supply
+// without a separate request per file
+struct DirEntry {
+  string name;
+  Filetype type;
+  unsigned long long size;              // size in bytes
+  time_t mtime;                         // last modification time
+};
+
 enum OpenMode {
   ReadOnly,                             // open for reading
   Overwrite,                            // overwrite existing file
@@ -297,9 +478,18 @@ public:
                         list<string> &c) = 0;
   // get directory contents
 
+  virtual void scan(const string &path,
+                    list<DirEntry> &c) = 0;
+  // get directory contents with the type, size and mtime of each entry (not
+  // following symlinks)
+
   virtual Filetype type(const string &path) = 0;
   // get file type
 
+  virtual void attributes(const string &path, DirEntry &e) = 0;
+  // get the type, size and mtime of PATH (following symlinks).  E's name is
+  // left alone.
+
   virtual string readlink(const string &path);
   // read the contents of a link
 
@@ -309,13 +499,62 @@ public:
   virtual void utimes(const string &path, time_t atime, time_t mtime);
   // set file times
 
+  virtual void init();
+  // get ready for use, if that has not been done yet.  This is done
+  // automatically but doing it in advance means the filesystem can then be
+  // handed to another thread.
+
   virtual void prefigure_exists(const string &path);
   // prefetch existence information
 
+  virtual void prefetch(const string &path);
+  // start reading the contents of PATH in the background
+
+  virtual void uncache(const string &path);
+  // drop the contents of PATH from any cache
+
+  virtual bool checkfile(const string &path, uint8_t h[HASH_SIZE]);
+  // compute the hash of PATH where it lives, without reading its contents
+  // here.  Returns false if this filesystem can't.
+
+  virtual void prefigure_checkfile(const string &path);
+  // start computing the hash of PATH for a later checkfile()
+
+  virtual void fsync(const string &path, bool dataonly = false);
+  // flush PATH (a file or directory) to stable storage
+
+  virtual void syncfs(const string &path);
+  // flush the whole filesystem containing PATH to stable storage
+
   // make PATH and its parent directories
-  void makedirs(const string &path);
+  virtual void makedirs(const string &path);
+
+  // make each of PATHS in order (so parents must come before their children),
+  // tolerating ones that already exist
+  virtual void mkdirs(const list<string> &paths);
+
+  // remove each of PATHS, reporting any that cannot be removed as errors
+  // rather than giving up
+  virtual void removes(const list<string> &paths);
+
+  // copy the rest of SRC to PATH in a single stream, creating PATH's parent
+  // directories as needed and replacing PATH atomically at the end.  If HASH
+  // is not null and SRC turns out not to match it, nothing is installed and
+  // FileChanged is thrown.  Returns false, having done nothing, if this
+  // filesystem can't do that any better than open() and rename().  The copy
+  // may still be under way when this returns; see finish_installs().
+  virtual bool install(const string &path, File *src, const uint8_t *hash);
+
+  // wait for every install() to complete, throwing an exception if any failed
+  virtual void finish_installs();
+
+private:
+  void mkdir_exists_ok(const string &path);
 };
 
+Filetype filetype(mode_t mode);
+// Return the Filetype for the S_IFMT bits of MODE
+
 // Local Filesystem -----------------------------------------------------------
 
 // File on a local filesystem
@@ -329,9 +568,15 @@ public:
   ~LocalFile();
   bool readable() const;                // return true if can read without
                                         // blocking
+  bool fastcopy(File *src);
+  bool clone(File *src);
+  static int open_readonly(const string &path);
+  // open PATH for reading, without changing its access time if
+  // --preserve-atime is in force and that is permitted
 private:
   int readbytes(void *buf, int space);
   void writebytes(const void *buf, int nbytes);
+  size_t preferred_iosize() const;
 };
 
 // A local filesystem
@@ -350,34 +595,90 @@ public:
   int exists(const string &path);
   void contents(const string &path,
                 list<string> &c);
+  void scan(const string &path,
+            list<DirEntry> &c);
   string readlink(const string &path);
   bool ismount(const string &path);
   void utimes(const string &path, time_t atime, time_t mtime);
   Filetype type(const string &path);
+  void attributes(const string &path, DirEntry &e);
+  void fsync(const string &path, bool dataonly);
+  void syncfs(const string &path);
+  void prefetch(const string &path);
+  void uncache(const string &path);
 };
 
 extern LocalFilesystem local;
 
 // SFTP filesystem ------------------------------------------------------------
 
+class SftpFilesystem;
+
+// An asynchronous SFTP operation, started by one of the
+// SftpFilesystem::start_...() methods.  complete() is called with the reply
+// when it arrives, from inside whichever SftpFilesystem call happens to read
+// it, so it must not throw.  The operation is finished once DONE is set.
+//
+// The default complete() just keeps the reply, so a plain SftpRequest serves
+// as a future; override it to act on the reply instead.
+class SftpRequest {
+public:
+  bool done;                            // true once finished
+  string reply;                         // the final reply
+  inline SftpRequest(): done(false) {}
+  virtual ~SftpRequest();
+  virtual void complete(SftpFilesystem *fs, string &reply);
+};
+
 class SftpFilesystem : public Filesystem {
   const string &userhost;
   LocalFile *in, *out;
   pid_t pid;
   uint32_t id;
-  map<uint32_t, string> replies;        // pending replies
-  set<uint32_t> ignored;                // ignored IDs
-  struct exists_inflight {
+  // An outstanding request and, once it has arrived, its reply
+  struct Reply {
     uint32_t id;
-    string path;
-    inline exists_inflight(const uint32_t id_, const string &path_):
-      id(id_), path(path_) {}
+    enum { Free, Waiting, Arrived, Ignored } state;
+    SftpRequest *callback;              // handed the reply, if not null
+    string payload;
+    inline Reply(): id(0), state(Free), callback(0) {}
   };
-  list<exists_inflight> existence_inflight; // in-flight existence tests
-  map<string, bool> existence;          // cached existence information
+  vector<Reply> slots;                  // indexed by ID % SFTP_REPLY_SLOTS
+  map<uint32_t, Reply> overflow;        // requests displaced from slots
+  // Operations that take more than one request
+  class RemoveOp;
+  class RenameOp;
+  class ExistsOp;
+  class ExistsBatchOp;
+  class CheckFileOp;
+  class PutOp;
+  map<string, int> existence;           // cached existence information
+                                        // (-1 while the STAT is in flight)
+  vector<string> exists_batch;          // paths waiting for AGENT_EXISTS
+  size_t exists_inflight;               // AGENT_EXISTS queries in flight
+  size_t puts_inflight;                 // AGENT_PUT chunks in flight
+  string put_failure;                   // first failed AGENT_PUT reply
+  string put_failure_path;              // ...and the path it was for
+  map<string, string> prehashed;        // check-file replies for
+                                        // prefigure_checkfile() (empty while
+                                        // in flight)
+  set<string> knowndirs;                // directories known to exist
+  map<string, string> extensions;       // extensions the server supports
+  uint32_t maxread;                     // largest READ to send
+  uint32_t maxwrite;                    // largest WRITE to send
+  size_t readwindow;                    // READs to keep in flight
+  bool posix_rename;                    // use posix-rename extension
+  bool check_file_name;                 // use check-file-name extension
+  bool check_file_handle;               // use check-file-handle extension
+  bool agent_exists;                    // use AGENT_EXISTS extension
+  bool agent_put;                       // use AGENT_PUT extension
 public:
   inline SftpFilesystem(const string &userhost_) :
-    userhost(userhost_), in(0), out(0), pid(-1), id(0) {}
+    userhost(userhost_), in(0), out(0), pid(-1), id(0),
+    slots(SFTP_REPLY_SLOTS), exists_inflight(0), puts_inflight(0),
+    maxread(SFTP_IO_SIZE), maxwrite(SFTP_IO_SIZE), readwindow(SFTP_READ_WINDOW),
+    posix_rename(false), check_file_name(false), check_file_handle(false),
+    agent_exists(false), agent_put(false) {}
   virtual ~SftpFilesystem();
 
   void rename(const string &oldpath, const string &newpath);
@@ -389,29 +690,88 @@ public:
   int exists(const string &path);
   void contents(const string &path,
                 list<string> &c);
+  void scan(const string &path,
+            list<DirEntry> &c);
   Filetype type(const string &path);
+  void attributes(const string &path, DirEntry &e);
   void prefigure_exists(const string &path);
+  void makedirs(const string &path);
+  void mkdirs(const list<string> &paths);
+  void removes(const list<string> &paths);
+  bool checkfile(const string &path, uint8_t h[HASH_SIZE]);
+  void prefigure_checkfile(const string &path);
+  bool install(const string &path, File *src, const uint8_t *hash);
+  void finish_installs();
+  void init();
+
+  // Asynchronous operations.  These send their request without flushing or
+  // waiting and arrange for REQ's complete() to be called with the outcome.
+  // REQ must stay valid until then.  Any number may be in flight at once.
+
+  void start_open(const string &path, OpenMode mode, SftpRequest *req);
+  // Open PATH.  The reply is an SSH_FXP_HANDLE on success; see opened().
+
+  void start_remove(const string &path, SftpRequest *req);
+  // Remove PATH, trying RMDIR if REMOVE fails
+
+  void start_rename(const string &oldpath, const string &newpath,
+                    SftpRequest *req);
+  // Rename OLDPATH to NEWPATH, replacing NEWPATH if it exists
 
-  static bool posix_rename;             // use remote posix-rename extension
+  void start_mkdir(const string &path, mode_t mode, SftpRequest *req);
+  // Create directory PATH
+
+  void start_stat(const string &path, SftpRequest *req);
+  void start_lstat(const string &path, SftpRequest *req);
+  // Get PATH's attributes, following symlinks or not.  The reply is an
+  // SSH_FXP_ATTRS on success.
+
+  File *opened(const string &path, const SftpRequest &req);
+  // Return the file opened by a finished start_open() request, or throw an
+  // exception if it failed
+
+  void wait(SftpRequest *req);
+  // Read replies until REQ has finished
 
 private:
-  void connect();
-  // Connect to the SFTP server
-  
-  void init();
-  // Initialize
+  void connect(bool agent);
+  // Connect to the SFTP server, or to the --remote-agent if AGENT is true
+
+  void disconnect();
+  // Drop a connection that failed during setup
+
+  uint8_t handshake(string &reply);
+  // Send SSH_FXP_INIT and read the reply into REPLY.  Returns the reply's
+  // type, or 0 if the connection closed first.
+
+  void limits();
+  // Find out the server's limits, if it will say
 
-  uint32_t newid();
-  // Create a fresh ID, which will never be 0.
+  uint32_t newid(SftpRequest *callback = 0);
+  // Create a fresh ID, which will never be 0, and expect a reply to it.  If
+  // CALLBACK is not null then the reply is handed to it; otherwise the ID
+  // must eventually be passed to await() or ignore().
+
+  Reply *find(uint32_t id);
+  // Return the table entry for ID, or a null pointer if there isn't one
+
+  void release(Reply *r);
+  // Forget about request R
 
   void send(const string &cmd);
   // Send a command (does not flush).
 
+  void send(const string &cmd, const void *data, size_t nbytes);
+  // Send a command whose last field is the string DATA, without copying DATA
+  // into CMD first.  CMD must include everything before DATA's length word.
+  // Does not flush.
+
   uint8_t recv(string &reply);
   // Receive a command.  Returns the type.
 
   uint8_t await(uint32_t id, string &reply);
-  // Wait for the reply to ID
+  // Wait for the reply to ID, flushing any buffered commands first if it
+  // hasn't already arrived
 
   void poll();
   // Read replies
@@ -432,10 +792,40 @@ private:
   void ignore(uint32_t id);
   // Mark ID as to be ignored if a reply comes in
 
+  uint32_t sendmkdir(const string &path, mode_t mode,
+                     SftpRequest *callback = 0);
+  // Send a MKDIR and return the ID.  Doesn't flush or wait.
+
+  uint32_t sendpath(uint8_t type, const string &path,
+                    SftpRequest *callback = 0);
+  // Send a command of type TYPE whose only argument is PATH (e.g. LSTAT or
+  // REMOVE) and return the ID.  Doesn't flush or wait.
+
+  uint32_t sendrename(const string &oldpath, const string &newpath,
+                      SftpRequest *callback = 0);
+  // Send a RENAME, or a posix-rename if the server supports it, and return
+  // the ID.  Doesn't flush or wait.
+
   uint32_t closehandle(const string &handle);
   // Close a handle and return the ID.  Doesn't flush or wait.
+
+  uint32_t sendcheckfile(const char *extension, const string &arg,
+                         SftpRequest *callback = 0);
+  // Send a check-file-name or check-file-handle (according to EXTENSION) for
+  // the whole of ARG, and return the ID.  Doesn't flush or wait.
+
+  void send_exists_batch();
+  // Send an AGENT_EXISTS query for the paths in exists_batch.  Doesn't flush.
+
+  void sendput(const string &path, uint64_t offset, uint32_t flags,
+               const string &data);
+  // Send an AGENT_PUT chunk, first waiting until fewer than sftp_writes are
+  // in flight.  Doesn't flush.
+
+  void check_puts();
+  // Raise an exception if an AGENT_PUT has failed
   
-  bool ready(uint32_t id) const;
+  bool ready(uint32_t id);
   // Return true if the reply to ID is available
 
   friend class SftpFile;
@@ -443,6 +833,34 @@ private:
 
 // SftpFile is hidden away in sftp.c
 
+// Index Files ----------------------------------------------------------------
+
+File *openindex(Filesystem *fs, const string &path);
+// Open index file PATH for reading, decompressing it if necessary
+
+File *createindex(Filesystem *fs, const string &path);
+// Create index file PATH, compressing it if --compress-index was given
+
+File *createdelta(File *index, Filesystem *fs, const string &basepath);
+// Wrap INDEX so that it is written as a delta against BASEPATH
+
+File *resolvedelta(File *delta, Filesystem *fs);
+// Return a file presenting delta index DELTA merged with its base
+
+// Read an index file one directory at a time
+class IndexBlockReader {
+private:
+  File *f;
+  string line;                          // next line, if lookahead is set
+  bool lookahead;
+public:
+  IndexBlockReader(File *f_);
+
+  bool next(string &dir, string &text);
+  // Read all the lines for the next directory into TEXT, and its name into
+  // DIR ("" for the root).  Returns false at the end of the index.
+};
+
 // Exclusion ------------------------------------------------------------------
 
 class Exclusion {
@@ -487,6 +905,17 @@ public:
 void hashfile(Filesystem *fs, const string &path, uint8_t h[HASH_SIZE],
               bool mmap_hint = false);
 
+// A hash value, for use in containers
+struct HashValue {
+  uint8_t h[HASH_SIZE];
+  inline bool operator<(const HashValue &that) const {
+    return memcmp(h, that.h, HASH_SIZE) < 0;
+  }
+  inline bool operator==(const HashValue &that) const {
+    return !memcmp(h, that.h, HASH_SIZE);
+  }
+};
+
 // A set of hashes, implemented as a hashtable.
 class HashSet {
 private:
@@ -514,6 +943,25 @@ public:
   // Dump stats
 };
 
+// Hash Manifests -------------------------------------------------------------
+
+// Suffix added to an index name to get the name of its hash manifest
+#define MANIFEST_SUFFIX ".hashes"
+
+void write_manifest(Filesystem *fs, const string &indexpath,
+                    vector<HashValue> &hashes);
+// Write the manifest for INDEXPATH, which must already be complete.  HASHES is
+// sorted and deduplicated.
+
+int read_manifest(Filesystem *fs, const string &indexpath,
+                  vector<HashValue> &hashes);
+// Read the manifest for INDEXPATH into HASHES.  Returns 1 on success or 0 if
+// there is no manifest, it is corrupt or INDEXPATH has changed since it was
+// written.
+
+bool is_manifest(Filesystem *fs, const string &path);
+// Return true if PATH is a hash manifest
+
 // Encoding Conversion --------------------------------------------------------
 
 class Recode {
@@ -530,12 +978,30 @@ private:
 extern string repo, indexfile, root, sftphost;
 extern int crossfs, preserve_atime, overwrite_index, deleteclean, verbose;
 extern int permissions;
+extern int jobs;
 extern bool detectbogus;
 extern Exclusions exclusions;
 extern const char *sftpserver;
+extern const char *remoteagent;
 extern bool recheckhash;
+extern bool syncrepo;
+extern bool dropcache;
+extern bool compressindex;
+extern string baseindex;
+extern size_t io_size;
+extern int sftp_writes;
+extern int sftp_connections;
+
+// How restore creates files that were saved by hash
+enum RestoreMethod {
+  RestoreCopy,                          // copy them
+  RestoreReflink,                       // clone them from the repository
+  RestoreHardlink                       // link them to the repository
+};
+extern RestoreMethod restoremethod;
 
 extern Filesystem *hostfs, *backupfs;
+extern vector<Filesystem *> reposessions; // extra connections to backupfs
 extern const char *from_encoding, *to_encoding;
 extern string hintfile;
 
@@ -544,30 +1010,129 @@ extern string hintfile;
 void fatal(const char *msg, ...) __attribute__((noreturn));
 void warning(const char *msg, ...);
 void error(const char *msg, ...);
-string uid2string(uid_t uid);
-string gid2string(gid_t gid);
+
+// A warning or error saved up by a thread, to be reported later
+struct DivertedMessage {
+  bool iserror;
+  string text;
+  inline DivertedMessage(bool iserror_, const string &text_):
+    iserror(iserror_), text(text_) {}
+};
+
+void divert_messages(list<DivertedMessage> *messages);
+// Save warnings and errors from the calling thread in MESSAGES instead of
+// reporting them, or report them as normal if MESSAGES is null.
+
+void replay_messages(const list<DivertedMessage> &messages);
+// Report saved warnings and errors
+const string &uid2string(uid_t uid);
+const string &gid2string(gid_t gid);
 uid_t string2uid(const string &s);
 gid_t string2gid(const string &s);
 string hexencode(const uint8_t *h, size_t len);
+char *hexencode(char *out, const uint8_t *h, size_t len);
 void hexdecode(const string &hex, string &bytes);
 string urlencode(const string &s);
+char *urlencode(char *out, const char *s, size_t len);
 string urldecode(const string &s, size_t start = 0, size_t end = string::npos);
 void hashdecode(const string &hex, uint8_t h[HASH_SIZE]);
 string hashpath(const uint8_t *h);
+char *hashpath(char *out, const uint8_t *h);
+void objectpath(string &path, const uint8_t *h);
 int readIndexLine(File *f, map<string,string> &l);
 int parseIndexLine(const string &line, map<string,string> &l);
 const string *getdetail(const map<string,string> &details,
                         const char *key);
+int compare_dirs(const string &a, const string &b);
+bool volatile_detail(const string &key);
+bool same_index_text(const string &a, const string &b);
 
 extern void (*exitfn)(int);
 
+// Work Queues ----------------------------------------------------------------
+
+// Something for a WorkQueue to do
+class WorkItem {
+public:
+  virtual ~WorkItem();
+
+  virtual void run(Filesystem *fs) = 0;
+  // Do it, accessing the repository through FS.  Errors are reported by
+  // throwing an exception.
+};
+
+// A queue of WorkItems worked through by a pool of threads, each with a
+// Filesystem of its own.  After the first failure everything still queued is
+// discarded, and the failure is reported by fatal() from the next call to
+// add(), wait() or finish().
+class WorkQueue {
+public:
+  WorkQueue(size_t maxlength_);
+  virtual ~WorkQueue();
+
+  void start(const vector<Filesystem *> &fss);
+  // Start one thread for each member of FSS, which must be ready for use
+  // (see Filesystem::init())
+
+  inline bool running() const { return !workers.empty(); }
+  // Return true if start() has been called and finish() hasn't
+
+  void add(WorkItem *w);
+  // Queue W, first waiting until fewer than MAXLENGTH items are waiting.
+  // The queue takes ownership of W.
+
+  void wait();
+  // Wait until everything queued so far is done
+
+  void finish();
+  // Wait until everything is done and stop the threads
+
+  inline void lock() { pthread_mutex_lock(&mutex); }
+  inline void unlock() { pthread_mutex_unlock(&mutex); }
+  // For work that has to be serialized with other threads
+
+protected:
+  virtual void done(Filesystem *fs);
+  // Called by each thread, with the queue unlocked, once there is nothing
+  // left for it to do.  FS is its Filesystem.
+
+private:
+  struct Worker {
+    WorkQueue *q;
+    Filesystem *fs;
+    pthread_t id;
+  };
+  vector<Worker> workers;
+  list<WorkItem *> items;               // work waiting to be done
+  size_t length;                        // length of items
+  size_t maxlength;                     // maximum length of items
+  size_t busy;                          // items being worked on
+  bool finished;                        // nothing more will be queued
+  string failure;                       // first error from a thread
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;                  // signaled when anything changes
+
+  static void *thread(void *arg);
+  void check();
+};
+
 // Operations -----------------------------------------------------------------
 
 void do_backup();
 void do_restore();
 void do_verify();
+void do_verify_all();
 void do_clean(int argc, char **argv);
 void do_speedtest();
+void do_compact();
+void do_init_repo();
+void do_diff(int argc, char **argv);
+void do_agent();
+
+void sftp_serve(const char *extensions, bool extended = false);
+// Serve SFTP on stdin and stdout, offering the extensions in the
+// comma-separated list EXTENSIONS, until the client goes away.  If EXTENDED
+// is set then every set of file attributes has some extended attributes too.
 
 // Miscellaneous --------------------------------------------------------------
 
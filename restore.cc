@@ -20,6 +20,75 @@
 #include "nhbackup.h"
 #include <sys/un.h>
 
+// Restore Readers ------------------------------------------------------------
+
+/* With --sftp-connections, files saved by hash are copied out of the
+ * repository by a pool of threads, each with its own connection, which also
+ * set the restored files' ownership, permissions and times and rename them
+ * into place.  Everything else is done by the thread reading the index.
+ */
+
+// A file to copy out of the repository
+struct restorable: public WorkItem {
+  string hp;                            // path in repository
+  string tmpname;                       // where to copy it
+  string fullname;                      // where it finally goes
+  uid_t uid;
+  gid_t gid;
+  mode_t mode;
+  time_t atime, mtime;
+
+  void run(Filesystem *fs);
+};
+
+static WorkQueue *readq;                // null if there are no restore threads
+
+// Copy this file out of the repository, accessed through FS, and into place
+void restorable::run(Filesystem *fs) {
+  File *src = 0, *dst = 0;
+
+  try {
+    dst = hostfs->open(tmpname, Overwrite);
+    src = fs->open(hp, ReadOnly);
+    src->copyto(dst);
+    dst->flush();
+  } catch(...) {
+    if(src) delete src;
+    if(dst) delete dst;
+    throw;
+  }
+  delete src;
+  delete dst;
+  if(dropcache)
+    hostfs->uncache(tmpname);
+  if(permissions) {
+    hostfs->lchown(tmpname, uid, gid);
+    hostfs->chmod(tmpname, mode);
+  }
+  hostfs->utimes(tmpname, atime, mtime);
+  hostfs->rename(tmpname, fullname);
+}
+
+// Start the restore threads, if there are to be any
+static void start_readers() {
+  if(reposessions.empty())
+    return;
+  // Connect before there are any other threads
+  for(size_t n = 0; n < reposessions.size(); ++n)
+    reposessions[n]->init();
+  readq = new WorkQueue(READ_QUEUE_LENGTH);
+  readq->start(reposessions);
+}
+
+// Wait for the restore threads to finish and stop them
+static void finish_readers() {
+  if(!readq)
+    return;
+  readq->finish();
+  delete readq;
+  readq = 0;
+}
+
 // Restore --------------------------------------------------------------------
 
 struct dirstamp {
@@ -41,12 +110,17 @@ void do_restore() {
   if(repo == "") fatal("no repository specified");
   if(root == "") fatal("no root specified");
   if(indexfile == "") fatal("no index specified");
+  if(restoremethod != RestoreCopy && (backupfs != &local || hostfs != &local))
+    fatal("--reflink and --hardlink require a local repository");
 
-  File *f = backupfs->open(indexfile, ReadOnly);
+  File *f = openindex(backupfs, indexfile);
   map<string,string> details;
   map<ino_t, string> inodes;
+  string hp;
   if(verbose)
     fprintf(stderr, "restoring from %s\n", indexfile.c_str());
+  if(restoremethod == RestoreCopy)
+    start_readers();
   while(readIndexLine(f, details)) {
     string name = recoder.convert(details["name"]);
 
@@ -81,6 +155,9 @@ void do_restore() {
       map<ino_t, string>::const_iterator inodepath = inodes.find(inodenum);
       if(inodepath != inodes.end()) {
         ++total_hardlinks;
+        // The first link might still be being restored
+        if(readq)
+          readq->wait();
         hostfs->link(inodepath->second, tmpname);
         hostfs->rename(tmpname, fullname);
         // don't mess about with permissions
@@ -90,6 +167,7 @@ void do_restore() {
     
     mode_t mode = strtol(details["perms"].c_str(), 0, 8);
     const string *type = getdetail(details, "type");
+    bool linked = false;                // linked to the repository
     if(type) {
       if(*type == "link") {
         ++total_links;
@@ -161,24 +239,49 @@ void do_restore() {
         uint8_t h[HASH_SIZE];
 
         hashdecode(*hash, h);
-        const string hp = repo + "/" + HASH_NAME + "/" + hashpath(h);
+        objectpath(hp, h);
 
-        try {
-          static char buffer[4096];
-          int n;
-
-          dst = hostfs->open(tmpname, Overwrite);
-          src = backupfs->open(hp, ReadOnly);
-          while((n = src->getbytes(buffer, sizeof buffer, false)))
-            dst->put(buffer, n);
-          dst->flush();
-        } catch(...) {
-          if(src) delete src;
-          if(dst) delete dst;
-          throw;
+        if(restoremethod == RestoreHardlink) {
+          hostfs->link(hp, tmpname);
+          linked = true;
+          ++fast_copies;
+        } else if(readq) {
+          // Leave the rest to the restore threads
+          restorable *const r = new restorable();
+          r->hp = hp;
+          r->tmpname = tmpname;
+          r->fullname = fullname;
+          r->uid = string2uid(details["uid"]);
+          r->gid = string2gid(details["gid"]);
+          r->mode = mode;
+          r->atime = strtoull(details["atime"].c_str(), 0, 10);
+          r->mtime = strtoull(details["mtime"].c_str(), 0, 10);
+          readq->add(r);
+          if(inode)
+            inodes[inodenum] = fullname;
+          continue;
+        } else {
+          try {
+            dst = hostfs->open(tmpname, Overwrite);
+            src = backupfs->open(hp, ReadOnly);
+            if(restoremethod == RestoreReflink) {
+              if(!dst->clone(src))
+                fatal("cannot reflink %s to %s", hp.c_str(), tmpname.c_str());
+            } else
+              src->copyto(dst);
+            dst->flush();
+          } catch(...) {
+            if(src) delete src;
+            if(dst) delete dst;
+            throw;
+          }
+          delete src;
+          delete dst;
+          if(dropcache) {
+            backupfs->uncache(hp);
+            hostfs->uncache(tmpname);
+          }
         }
-        delete src;
-        delete dst;
       } else {
         // Must be from the future
         error("%s does not have a known hash", name.c_str());
@@ -189,6 +292,12 @@ void do_restore() {
         // future
         inodes[inodenum] = fullname;
       }
+      if(linked) {
+        // The file is the repository's copy, so its permissions and times
+        // must be left alone
+        hostfs->rename(tmpname, fullname);
+        continue;
+      }
     }
     // Fix permissions and rename into place
     if(permissions)
@@ -210,6 +319,7 @@ void do_restore() {
     hostfs->rename(tmpname, fullname);
   }
   delete f;
+  finish_readers();
   // Fix up directory timestamps now that all the contents have been created
   if(verbose)
     fprintf(stderr, "fixing directory timestamps\n");
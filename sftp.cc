@@ -18,178 +18,10 @@
  * USA
  */
 #include "nhbackup.h"
+#include "sftp.h"
 #include <csignal>
 #include <sys/wait.h>
 
-// packets types from draft-ietf-secsh-filexfer-02.txt 3
-static const uint8_t SSH_FXP_INIT                =1;
-static const uint8_t SSH_FXP_VERSION             =2;
-static const uint8_t SSH_FXP_OPEN                =3;
-static const uint8_t SSH_FXP_CLOSE               =4;
-static const uint8_t SSH_FXP_READ                =5;
-static const uint8_t SSH_FXP_WRITE               =6;
-static const uint8_t SSH_FXP_LSTAT               =7;
-static const uint8_t SSH_FXP_FSTAT               =8;
-static const uint8_t SSH_FXP_SETSTAT             =9;
-static const uint8_t SSH_FXP_FSETSTAT           =10;
-static const uint8_t SSH_FXP_OPENDIR            =11;
-static const uint8_t SSH_FXP_READDIR            =12;
-static const uint8_t SSH_FXP_REMOVE             =13;
-static const uint8_t SSH_FXP_MKDIR              =14;
-static const uint8_t SSH_FXP_RMDIR              =15;
-static const uint8_t SSH_FXP_REALPATH           =16;
-static const uint8_t SSH_FXP_STAT               =17;
-static const uint8_t SSH_FXP_RENAME             =18;
-static const uint8_t SSH_FXP_READLINK           =19;
-static const uint8_t SSH_FXP_SYMLINK            =20;
-static const uint8_t SSH_FXP_STATUS            =101;
-static const uint8_t SSH_FXP_HANDLE            =102;
-static const uint8_t SSH_FXP_DATA              =103;
-static const uint8_t SSH_FXP_NAME              =104;
-static const uint8_t SSH_FXP_ATTRS             =105;
-static const uint8_t SSH_FXP_EXTENDED          =200;
-static const uint8_t SSH_FXP_EXTENDED_REPLY    =201;
-
-// attribute flag bits from draft-ietf-secsh-filexfer-02.txt 5
-static const uint32_t SSH_FILEXFER_ATTR_SIZE          =0x00000001;
-static const uint32_t SSH_FILEXFER_ATTR_UIDGID        =0x00000002;
-static const uint32_t SSH_FILEXFER_ATTR_PERMISSIONS   =0x00000004;
-static const uint32_t SSH_FILEXFER_ATTR_ACMODTIME     =0x00000008;
-static const uint32_t SSH_FILEXFER_ATTR_EXTENDED      =0x80000000;
-
-// pflags from draft-ietf-secsh-filexfer-02.txt 6.3
-static const uint32_t SSH_FXF_READ            =0x00000001;
-static const uint32_t SSH_FXF_WRITE           =0x00000002;
-static const uint32_t SSH_FXF_APPEND          =0x00000004;
-static const uint32_t SSH_FXF_CREAT           =0x00000008;
-static const uint32_t SSH_FXF_TRUNC           =0x00000010;
-static const uint32_t SSH_FXF_EXCL            =0x00000020;
-
-// status codes from draft-ietf-secsh-filexfer-02.txt 7
-static const uint32_t SSH_FX_OK                            =0;
-static const uint32_t SSH_FX_EOF                           =1;
-static const uint32_t SSH_FX_NO_SUCH_FILE                  =2;
-static const uint32_t SSH_FX_PERMISSION_DENIED             =3;
-static const uint32_t SSH_FX_FAILURE                       =4;
-static const uint32_t SSH_FX_BAD_MESSAGE                   =5;
-static const uint32_t SSH_FX_NO_CONNECTION                 =6;
-static const uint32_t SSH_FX_CONNECTION_LOST               =7;
-static const uint32_t SSH_FX_OP_UNSUPPORTED                =8;
-
-struct Status {
-  uint32_t status;
-  string message;
-  string lang;
-};
-
-struct Attributes {
-  uint32_t flags;
-  uint64_t size;
-  uint32_t uid;
-  uint32_t gid;
-  uint32_t permissions;
-  uint32_t atime;
-  uint32_t mtime;
-  map<string, string> extended;
-};
-
-static inline void pack_uint8(string &s, uint8_t byte) {
-  s += (char)byte;
-}
-
-static void pack_uint32(string &s, uint32_t u) {
-  pack_uint8(s, (uint8_t)(u >> 24));
-  pack_uint8(s, (uint8_t)(u >> 16));
-  pack_uint8(s, (uint8_t)(u >> 8));
-  pack_uint8(s, (uint8_t)u);
-}
-
-static void pack_uint64(string &s, uint64_t u) {
-  pack_uint8(s, (uint8_t)(u >> 56));
-  pack_uint8(s, (uint8_t)(u >> 48));
-  pack_uint8(s, (uint8_t)(u >> 40));
-  pack_uint8(s, (uint8_t)(u >> 32));
-  pack_uint8(s, (uint8_t)(u >> 24));
-  pack_uint8(s, (uint8_t)(u >> 16));
-  pack_uint8(s, (uint8_t)(u >> 8));
-  pack_uint8(s, (uint8_t)(u));
-}
-
-static void pack_string(string &s, const string &t) {
-  pack_uint32(s, (uint32_t)t.size());
-  s += t;
-}
-
-static void pack_bytes(string &s, const void *data, size_t n) {
-  pack_uint32(s, (uint32_t)n);
-  s.append((const char *)data, n);
-}
-
-static uint8_t unpack_uint8(const string &s, size_t &index) {
-  return s.at(index++);
-}
-
-static uint32_t unpack_uint32(const string &s, size_t &index) {
-  uint32_t n;
-
-  n = (uint32_t)unpack_uint8(s, index) << 24;
-  n += (uint32_t)unpack_uint8(s, index) << 16;
-  n += (uint32_t)unpack_uint8(s, index) << 8;
-  n += (uint32_t)unpack_uint8(s, index);
-  return n;
-}
-
-static uint64_t unpack_uint64(const string &s, size_t &index) {
-  uint64_t n;
-
-  n = (uint64_t)unpack_uint8(s, index) << 56;
-  n += (uint64_t)unpack_uint8(s, index) << 48;
-  n += (uint64_t)unpack_uint8(s, index) << 40; 
-  n += (uint64_t)unpack_uint8(s, index) << 32;
-  n += (uint64_t)unpack_uint8(s, index) << 24;
-  n += (uint64_t)unpack_uint8(s, index) << 16;
-  n += (uint64_t)unpack_uint8(s, index) << 8;
-  n += (uint64_t)unpack_uint8(s, index);
-  return n;
-}
-
-static string unpack_string(const string &s, size_t &index) {
-  uint32_t len = unpack_uint32(s, index);
-
-  index += len;
-  return string(s, index - len, len);
-}
-
-static void unpack_status(const string &s, size_t &index, Status &st) {
-  st.status = unpack_uint32(s, index);
-  st.message = unpack_string(s, index);
-  st.lang = unpack_string(s, index);
-}
-
-static void unpack_attrs(const string &s, size_t &index, Attributes &attrs) {
-  attrs.flags = unpack_uint32(s, index);
-  if(attrs.flags & SSH_FILEXFER_ATTR_SIZE)
-    attrs.size = unpack_uint64(s, index);
-  if(attrs.flags & SSH_FILEXFER_ATTR_UIDGID) {
-    attrs.uid = unpack_uint32(s, index);
-    attrs.gid = unpack_uint32(s, index);
-  }
-  if(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
-    attrs.permissions = unpack_uint32(s, index);
-  if(attrs.flags & SSH_FILEXFER_ATTR_ACMODTIME) {
-    attrs.atime = unpack_uint32(s, index);
-    attrs.mtime = unpack_uint32(s, index);
-  }
-  if(attrs.flags & SSH_FILEXFER_ATTR_EXTENDED) {
-    uint32_t count = unpack_uint32(s, index);
-    while(count > 0) {
-      const string k = unpack_string(s, index);
-      const string v = unpack_string(s, index);
-      attrs.extended[k] = v;
-    }
-  }
-}
-
 // SftpFileError --------------------------------------------------------------
 
 SftpFileError::SftpFileError(const char *doing,
@@ -216,17 +48,44 @@ private:
   string path;
   string handle;
 
+  // An outstanding READ.  If a read comes back short then the rest must be
+  // fetched before any later data is used, so the later data is kept here
+  // until then.
+  struct ReadRequest {
+    uint32_t id;
+    uint64_t offset;
+    uint32_t length;
+    bool received;                      // data has arrived
+    string reply;                       // the whole SSH_FXP_DATA reply
+    size_t start;                       // where the data starts in REPLY
+    uint32_t count;                     // how much data there is
+    inline ReadRequest(uint32_t id_, uint64_t offset_, uint32_t length_):
+      id(id_), offset(offset_), length(length_), received(false),
+      start(0), count(0) {}
+  };
+
   // queue of pending read operations
-  list<uint32_t> readqueue;
-  // remaining bytes readable
+  list<ReadRequest> readqueue;
+  // the reply being read from; bytes readstart to readend remain
   string readbuffer;
+  size_t readstart, readend;
   // offset to read at
   uint64_t readoffset;
   // set at eof
   bool eof;
-
-  // desired size of read queue
-  static const size_t readqueuesize = 8;
+  // number of READs to keep in flight for this file
+  size_t readwindow;
+  // part of the last reply that was missing, if length is nonzero
+  uint64_t gapoffset;
+  uint32_t gaplength;
+  // FSTAT sent when reading starts, so that short reads at the end of the
+  // file can be recognized without another round trip
+  uint32_t fstatid;
+  bool sizeknown;
+  uint64_t filesize;
+  // for reporting throughput
+  uint64_t bytesread;
+  struct timeval started;
 
   // outstanding writes
   list<uint32_t> writequeue;
@@ -238,67 +97,168 @@ public:
     fs(fs_), 
     path(path_),
     handle(handle_),
+    readstart(0),
+    readend(0),
     readoffset(0),
     eof(false),
+    readwindow(2),
+    gapoffset(0),
+    gaplength(0),
+    fstatid(0),
+    sizeknown(false),
+    filesize(0),
+    bytesread(0),
     writeoffset(0) {
+    if(readwindow > fs->readwindow)
+      readwindow = fs->readwindow;
   }
 
   ~SftpFile() {
     synchronize();
+    for(list<ReadRequest>::const_iterator it = readqueue.begin();
+        it != readqueue.end();
+        ++it)
+      if(!it->received)
+        fs->ignore(it->id);
+    if(fstatid)
+      fs->ignore(fstatid);
     fs->ignore(fs->closehandle(handle));
   }
 
 private:
-  
-  int readbytes(void *buf, int space) {
-    if(!eof and readqueue.size() < readqueuesize) {
-      // Keep the read queue full
-      while(readqueue.size() < readqueuesize) {
-        string cmd;
-        const uint32_t id = fs->newid();
-        pack_uint8(cmd, SSH_FXP_READ);
-        pack_uint32(cmd, id);
-        pack_string(cmd, handle);
-        pack_uint64(cmd, readoffset);
-        pack_uint32(cmd, space);
-        readoffset += space;
-        fs->send(cmd);
-        // This looks inefficient but we hope that the local TCP implementation
-        // will batch things up.
+
+  size_t preferred_iosize() const {
+    // File::allocate() rounds up to a whole page, so round down here or the
+    // buffer would be a little more than one WRITE
+    const size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t size = fs->maxwrite / pagesize * pagesize;
+    if(!size)
+      size = fs->maxwrite;
+    return io_size && io_size < size ? io_size : size;
+  }
+
+  // Send a READ for LENGTH bytes at OFFSET
+  uint32_t sendread(uint64_t offset, uint32_t length) {
+    string cmd;
+    const uint32_t id = fs->newid();
+
+    pack_uint8(cmd, SSH_FXP_READ);
+    pack_uint32(cmd, id);
+    pack_string(cmd, handle);
+    pack_uint64(cmd, offset);
+    pack_uint32(cmd, length);
+    fs->send(cmd);
+    return id;
+  }
+
+  // Wait for the next piece of the file.  Returns false at EOF.
+  bool nextread() {
+    for(;;) {
+      ReadRequest &r = readqueue.front();
+      if(!r.received) {
+        // If we have to wait, and this file is already using the whole
+        // window, then the window isn't big enough to keep the link busy.
+        if(bytesread && !fs->ready(r.id) && readwindow >= fs->readwindow
+           && 2 * fs->readwindow * fs->maxread <= SFTP_MAX_READ_WINDOW)
+          readwindow = fs->readwindow *= 2;
+        if(fs->await(r.id, r.reply) == SSH_FXP_DATA) {
+          // The data is used where it lies rather than copied out
+          size_t index = 5;             // skip type + id
+          r.count = unpack_uint32(r.reply, index);
+          r.start = index;
+          if(r.count > r.reply.size() - index)
+            fatal("SFTP data reply truncated");
+        } else
+          // Report errors
+          fs->check("reading", path, r.reply, true);
+        r.received = true;
+      }
+      if(gaplength) {
+        // The last reply was short.  Fetch the missing part before using this
+        // one (even if this one is EOF, since the file might end in the
+        // gap).
+        readqueue.push_front(ReadRequest(sendread(gapoffset, gaplength),
+                                         gapoffset, gaplength));
         fs->out->flush();
-        readqueue.push_back(id);
+        gaplength = 0;
+        continue;
       }
-    }
-
-    if(!readbuffer.size() and readqueue.size()) {
-      // Nothing in the buffer but there are outstanding reads which might fill
-      // it.
-      const uint32_t id = readqueue.front();
-      readqueue.pop_front();
-      string reply;
-      const uint8_t r = fs->await(id, reply);
-      if(r == SSH_FXP_DATA) {
-        size_t index = 5;               // skip type + id
-        readbuffer = unpack_string(reply, index);
-      } else {
-        // Report errors
-        fs->check("reading", path, reply, true);
+      if(!r.count) {
         // We must be at EOF.  Ignore all the remaining reads and empty the
         // queue.
         while(readqueue.size()) {
-          fs->ignore(readqueue.front());
+          if(!readqueue.front().received)
+            fs->ignore(readqueue.front().id);
           readqueue.pop_front();
         }
-        eof = true;
+        return false;
       }
+      readbuffer.swap(r.reply);
+      readstart = r.start;
+      readend = r.start + r.count;
+      const uint64_t offset = r.offset;
+      const uint32_t length = r.length, count = r.count;
+      readqueue.pop_front();
+      bytesread += count;
+      if(count < length) {
+        // Short reads usually mean EOF, but the server is allowed to return
+        // less than was asked for anywhere.
+        if(fstatid) {
+          string reply;
+          if(fs->await(fstatid, reply) == SSH_FXP_ATTRS) {
+            size_t index = 5;           // skip type + id
+            Attributes attrs;
+            unpack_attrs(reply, index, attrs);
+            if(attrs.flags & SSH_FILEXFER_ATTR_SIZE) {
+              sizeknown = true;
+              filesize = attrs.size;
+            }
+          }
+          fstatid = 0;
+        }
+        gapoffset = offset + count;
+        if(!sizeknown || gapoffset < filesize)
+          gaplength = length - count;
+      } else if(readwindow < fs->readwindow)
+        // Open the window up as the file turns out to be big
+        readwindow = 2 * readwindow < fs->readwindow ? 2 * readwindow
+                                                     : fs->readwindow;
+      return true;
     }
+  }
 
-    if(readbuffer.size()) {
+  int readbytes(void *buf, int space) {
+    if(!bytesread && !eof && readqueue.empty()) {
+      gettimeofday(&started, 0);
+      string cmd;
+      fstatid = fs->newid();
+      pack_uint8(cmd, SSH_FXP_FSTAT);
+      pack_uint32(cmd, fstatid);
+      pack_string(cmd, handle);
+      fs->send(cmd);
+    }
+    if(!eof and readqueue.size() < readwindow) {
+      // Keep the read queue full
+      while(readqueue.size() < readwindow) {
+        readqueue.push_back(ReadRequest(sendread(readoffset, fs->maxread),
+                                        readoffset, fs->maxread));
+        readoffset += fs->maxread;
+      }
+      fs->out->flush();
+    }
+
+    if(readstart == readend and readqueue.size() and !nextread()) {
+      eof = true;
+      if(verbose)
+        report_rate();
+    }
+
+    if(readstart < readend) {
       // There are bytes in the buffer
-      if(readbuffer.size() < (size_t)space)
-        space = readbuffer.size();
-      memcpy(buf, readbuffer.data(), space);
-      readbuffer.erase(0, space);
+      if(readend - readstart < (size_t)space)
+        space = readend - readstart;
+      memcpy(buf, readbuffer.data() + readstart, space);
+      readstart += space;
       return space;
     }
 
@@ -306,66 +266,232 @@ private:
     return 0;
   }
 
-  void writebytes(const void *buf, int nbytes) {
-    if(!nbytes) return;
-    string cmd;
+  // Report how fast the file was read
+  void report_rate() const {
+    struct timeval now;
+
+    gettimeofday(&now, 0);
+    const double elapsed = (now.tv_sec - started.tv_sec)
+      + (now.tv_usec - started.tv_usec) / 1000000.0;
+    fprintf(stderr, "read %s: %llu bytes in %.3fs",
+            path.c_str(), (unsigned long long)bytesread, elapsed);
+    if(elapsed > 0)
+      fprintf(stderr, " (%.0f KB/s, window %lu)",
+              bytesread / elapsed / 1024, (unsigned long)readwindow);
+    fputc('\n', stderr);
+  }
 
-    const uint32_t id = fs->newid();
-    cmd.reserve(handle.size() + nbytes + 21);
-    pack_uint8(cmd, SSH_FXP_WRITE);
-    pack_uint32(cmd, id);
-    pack_string(cmd, handle);
-    pack_uint64(cmd, writeoffset);
-    pack_bytes(cmd, buf, nbytes);
-    fs->send(cmd);
-    writeoffset += nbytes;
-    fs->out->flush();
-    writequeue.push_back(id);
-    // Process any recently arrived replies.  In principle the replies might
-    // arrive out of order but in practice this seems a bit unlikely.
-    uint32_t ready_id;
-    while((ready_id = find_ready_write()))
-      synchronize_one(ready_id);
+  void writebytes(const void *buf, int nbytes) {
+    const char *ptr = (const char *)buf;
+
+    while(nbytes > 0) {
+      const uint32_t n = (uint32_t)nbytes < fs->maxwrite ? nbytes : fs->maxwrite;
+      // Only wait for the server when the window is full
+      while(writequeue.size() >= (size_t)sftp_writes)
+        synchronize_one();
+      string cmd;
+      const uint32_t id = fs->newid();
+      cmd.reserve(handle.size() + 21);
+      pack_uint8(cmd, SSH_FXP_WRITE);
+      pack_uint32(cmd, id);
+      pack_string(cmd, handle);
+      pack_uint64(cmd, writeoffset);
+      fs->send(cmd, ptr, n);
+      writeoffset += n;
+      writequeue.push_back(id);
+      ptr += n;
+      nbytes -= n;
+    }
+    // Process any recently arrived replies.  The server may in principle
+    // answer out of order, but then the early replies just wait until the
+    // ones before them are reaped.
+    while(writequeue.size() && fs->ready(writequeue.front()))
+      synchronize_one();
   }
 
-  void synchronize_one(uint32_t id = 0) {
+  // Reap the oldest outstanding write
+  void synchronize_one() {
     string reply;
     
-    if(!id)
-      id = writequeue.front();
-    // Wait for the reply to arrive
     fs->await(writequeue.front(), reply);
-    list<uint32_t>::iterator it;
-    for(it = writequeue.begin();
-        it != writequeue.end() && *it != id;
-        ++it)
-      ;
-    assert(it != writequeue.end());
-    // Remove it from the queue
-    writequeue.erase(it);
+    writequeue.pop_front();
     // Check for errors
     fs->check("writing to", path, reply);
   }
 
   void synchronize() {
-    // We don't care what order we reap the replies in
     while(writequeue.size())
       synchronize_one();
   }
 
-  // Return the ID of a write that has been replied to, or return 0 if there
-  // are none.
-  uint32_t find_ready_write() const {
-    for(list<uint32_t>::const_iterator it = writequeue.begin();
-        it != writequeue.end();
-        ++it) {
-      if(fs->ready(*it))
-        return *it;
+};
+
+// SftpRequest ----------------------------------------------------------------
+
+SftpRequest::~SftpRequest() {
+}
+
+void SftpRequest::complete(SftpFilesystem *, string &r) {
+  reply.swap(r);
+  done = true;
+}
+
+// Return true if REPLY is an SSH_FXP_STATUS with status code STATUS
+static bool status_is(const string &reply, uint32_t status) {
+  size_t index = 5;                     // skip type+id
+  return ((uint8_t)reply.at(0) == SSH_FXP_STATUS
+          && unpack_uint32(reply, index) == status);
+}
+
+// REMOVE, then RMDIR if that fails, since SFTP v3 can't say that the failure
+// was due to PATH being a directory
+class SftpFilesystem::RemoveOp : public SftpRequest {
+  string path;
+  SftpRequest *req;                     // caller's request
+  bool tried_rmdir;
+public:
+  inline RemoveOp(const string &path_, SftpRequest *req_):
+    path(path_), req(req_), tried_rmdir(false) {}
+
+  void complete(SftpFilesystem *fs, string &r) {
+    if(!tried_rmdir && status_is(r, SSH_FX_FAILURE)) {
+      tried_rmdir = true;
+      fs->sendpath(SSH_FXP_RMDIR, path, this);
+      return;
     }
-    // newid() never returns 0
-    return 0;
+    req->complete(fs, r);
+    delete this;
+  }
+};
+
+// A rename, falling back to a plain SFTP RENAME if posix-rename turns out not
+// to be supported.  Plain RENAME won't replace an existing file, so if it
+// fails and the target exists, the target is removed and the RENAME retried.
+// This isn't atomic: until the retry succeeds the target is missing, and its
+// new contents are only to be found at the old name.  So that doesn't pass
+// unnoticed, each such replacement is warned about.
+class SftpFilesystem::RenameOp : public SftpRequest {
+  string oldpath, newpath;
+  SftpRequest *req;                     // caller's request
+  enum { Renaming, Statting, Removing, Retrying } stage;
+  bool posix;                           // sent posix-rename
+  string failure;                       // reply to the first plain RENAME
+public:
+  inline RenameOp(const string &oldpath_, const string &newpath_,
+                  SftpRequest *req_):
+    oldpath(oldpath_), newpath(newpath_), req(req_), stage(Renaming),
+    posix(false) {}
+
+  void send(SftpFilesystem *fs) {
+    posix = fs->posix_rename;
+    fs->sendrename(oldpath, newpath, this);
+  }
+
+  void complete(SftpFilesystem *fs, string &r) {
+    switch(stage) {
+    case Renaming:
+      if(posix && status_is(r, SSH_FX_OP_UNSUPPORTED)) {
+        fs->posix_rename = false;
+        send(fs);
+        return;
+      }
+      if(!posix && status_is(r, SSH_FX_FAILURE)) {
+        failure.swap(r);
+        stage = Statting;
+        fs->sendpath(SSH_FXP_STAT, newpath, this);
+        return;
+      }
+      break;
+    case Statting:
+      if((uint8_t)r.at(0) != SSH_FXP_ATTRS) {
+        r.swap(failure);                // report the original failure
+        break;
+      }
+      stage = Removing;
+      fs->sendpath(SSH_FXP_REMOVE, newpath, this);
+      return;
+    case Removing:
+      if(!status_is(r, SSH_FX_OK))
+        break;
+      warning("%s: server lacks posix-rename, replacing non-atomically",
+              newpath.c_str());
+      stage = Retrying;
+      send(fs);
+      return;
+    case Retrying:
+      break;
+    }
+    req->complete(fs, r);
+    delete this;
   }
+};
+
+// A STAT whose outcome is recorded in the existence cache
+class SftpFilesystem::ExistsOp : public SftpRequest {
+  string path;
+public:
+  inline ExistsOp(const string &path_): path(path_) {}
+
+  void complete(SftpFilesystem *fs, string &r) {
+    fs->existence[path] = ((uint8_t)r.at(0) == SSH_FXP_ATTRS);
+    delete this;
+  }
+};
+
+// An AGENT_EXISTS query, whose answers are recorded in the existence cache.
+// If the agent refuses it then the paths are STATted one at a time instead.
+class SftpFilesystem::ExistsBatchOp : public SftpRequest {
+  vector<string> paths;
+public:
+  inline ExistsBatchOp(vector<string> &paths_) {
+    paths.swap(paths_);
+  }
+
+  void complete(SftpFilesystem *fs, string &r) {
+    --fs->exists_inflight;
+    size_t index = 5;                   // skip type+id
+    if((uint8_t)r.at(0) == SSH_FXP_EXTENDED_REPLY
+       && unpack_string(r, index).size() == paths.size()) {
+      index = 9;                        // skip type+id+length
+      for(size_t n = 0; n < paths.size(); ++n)
+        fs->existence[paths[n]] = r[index + n];
+    } else {
+      fs->agent_exists = false;
+      for(size_t n = 0; n < paths.size(); ++n)
+        fs->sendpath(SSH_FXP_STAT, paths[n], new ExistsOp(paths[n]));
+    }
+    delete this;
+  }
+};
+
+// A check-file-name sent by prefigure_checkfile(), whose reply is kept for
+// checkfile()
+class SftpFilesystem::CheckFileOp : public SftpRequest {
+  string path;
+public:
+  inline CheckFileOp(const string &path_): path(path_) {}
+
+  void complete(SftpFilesystem *fs, string &r) {
+    fs->prehashed[path].swap(r);
+    delete this;
+  }
+};
 
+// One chunk of an AGENT_PUT.  The first failure is kept for check_puts() to
+// report.
+class SftpFilesystem::PutOp : public SftpRequest {
+  string path;
+public:
+  inline PutOp(const string &path_): path(path_) {}
+
+  void complete(SftpFilesystem *fs, string &r) {
+    --fs->puts_inflight;
+    if(!status_is(r, SSH_FX_OK) && fs->put_failure.empty()) {
+      fs->put_failure.swap(r);
+      fs->put_failure_path = path;
+    }
+    delete this;
+  }
 };
 
 // SftpFilesystem -------------------------------------------------------------
@@ -387,6 +513,18 @@ void SftpFilesystem::send(const string &cmd) {
 #endif
 }
 
+void SftpFilesystem::send(const string &cmd, const void *data,
+                          size_t nbytes) {
+  while(in->readable())
+    poll();
+  string header;
+  pack_uint32(header, cmd.size() + 4 + nbytes);
+  header.append(cmd);
+  pack_uint32(header, nbytes);
+  out->put(header);
+  out->put((const char *)data, nbytes);
+}
+
 uint8_t SftpFilesystem::recv(string &reply) {
   string slen;
 
@@ -402,7 +540,7 @@ uint8_t SftpFilesystem::recv(string &reply) {
   return (uint8_t)reply[0];
 }
 
-void SftpFilesystem::connect() {
+void SftpFilesystem::connect(bool agent) {
   int inpipe[2], outpipe[2];
   int w;
 
@@ -412,6 +550,11 @@ void SftpFilesystem::connect() {
   try {
     if(pipe(inpipe) < 0) throw FileError("creating", "pipe", errno);
     if(pipe(outpipe) < 0) throw FileError("creating", "pipe", errno);
+    // Other connections' subprocesses mustn't hold this one's pipes open
+    for(int n = 0; n < 2; ++n) {
+      fcntl(inpipe[n], F_SETFD, FD_CLOEXEC);
+      fcntl(outpipe[n], F_SETFD, FD_CLOEXEC);
+    }
     switch(pid = fork()) {
     case -1: fatal("fork: %s", strerror(errno));
     case 0:
@@ -423,7 +566,13 @@ void SftpFilesystem::connect() {
       close(inpipe[1]);
       close(outpipe[0]);
       close(outpipe[1]);
-      if(sftpserver) {
+      if(agent) {
+        if(userhost != "<magic>")
+          execlp("ssh", "ssh", "-x", "-T", userhost.c_str(), remoteagent,
+                 "--agent", (char *)0);
+        else
+          execlp(remoteagent, remoteagent, "--agent", (char *)0);
+      } else if(sftpserver) {
         if(userhost != "<magic>")
           execlp("ssh", "ssh", "-x", "-T", userhost.c_str(), sftpserver, (char *)0);
         else
@@ -449,6 +598,17 @@ void SftpFilesystem::connect() {
   }
 }
 
+void SftpFilesystem::disconnect() {
+  int w;
+
+  delete in; in = 0;
+  delete out; out = 0;
+  if(pid != -1) {
+    waitpid(pid, &w, 0);
+    pid = -1;
+  }
+}
+
 SftpFilesystem::~SftpFilesystem() {
   int w;
 
@@ -462,76 +622,144 @@ SftpFilesystem::~SftpFilesystem() {
   }
 }
 
-void SftpFilesystem::init() { 
-  if(in) return;                        // idempotent
+uint8_t SftpFilesystem::handshake(string &reply) {
+  string cmd, slen;
 
-  connect();
-  
-  // Send the init command
-  string cmd, reply;    
-  cmd.reserve(5);
+  // Not send(), which would treat the server exiting as a fatal error
+  cmd.reserve(9);
+  pack_uint32(cmd, 5);
   pack_uint8(cmd, SSH_FXP_INIT);
   pack_uint32(cmd, 3);
-  send(cmd);
-  out->flush();
-  
+  try {
+    out->put(cmd);
+    out->flush();
+  } catch(FileError &) {
+    out->discard();
+    return 0;                           // it has already gone away
+  }
   // Synchronously await a reply
-  uint8_t r = recv(reply);
+  if(in->getbytes(slen, 4) != 4)
+    return 0;
+  size_t index = 0;
+  const uint32_t len = unpack_uint32(slen, index);
+  if(len == 0 || (uint32_t)in->getbytes(reply, len) != len)
+    return 0;
+  return (uint8_t)reply[0];
+}
+
+// Set once a --remote-agent has failed, so that later connections go
+// straight to SFTP
+static bool not_an_agent;
+
+void SftpFilesystem::init() { 
+  if(in) return;                        // idempotent
+
+  string reply;
+  uint8_t r = 0;
+  if(remoteagent && !not_an_agent) {
+    connect(true);
+    if(!(r = handshake(reply))) {
+      // Most likely it didn't understand --agent, which is what both
+      // sftp-server and older versions of nhbackup do.  Use plain SFTP
+      // instead.
+      if(verbose)
+        fprintf(stderr, "%s: %s --agent failed, falling back to SFTP\n",
+                userhost.c_str(), remoteagent);
+      disconnect();
+      not_an_agent = true;
+    }
+  }
+  if(!r) {
+    connect(false);
+    if(!(r = handshake(reply)))
+      fatal("SFTP connection to %s closed during setup", userhost.c_str());
+  }
   if(r != SSH_FXP_VERSION)
     fatal("expected SSH_FXP_VERSION, got %#x", (unsigned)r);
   size_t index = 1;                     // skip type
   const uint32_t version = unpack_uint32(reply, index);
   if(version < 3)
     fatal("expected SFTP version at least 3, got %lu", (unsigned long)version);
-  // TODO record xdata
+  // The rest of the reply lists the extensions the server supports
+  while(index < reply.size()) {
+    const string name = unpack_string(reply, index);
+    extensions[name] = unpack_string(reply, index);
+  }
+  posix_rename = extensions.find(POSIX_RENAME) != extensions.end();
+  check_file_name = extensions.find("check-file-name") != extensions.end();
+  check_file_handle = extensions.find("check-file-handle") != extensions.end();
+  agent_exists = extensions.find(AGENT_EXISTS) != extensions.end();
+  agent_put = extensions.find(AGENT_PUT) != extensions.end();
+  if(verbose && (agent_exists || agent_put))
+    fprintf(stderr, "%s is an nhbackup agent\n", userhost.c_str());
+  if(extensions.find(OPENSSH_LIMITS) != extensions.end())
+    limits();
 }
 
-void SftpFilesystem::rename(const string &oldpath, const string &newpath) {
-  // Ensure initialized
-  init();
-
-  // Send the command
+void SftpFilesystem::limits() {
+  string cmd, reply;
   const uint32_t id = newid();
-  string cmd;
-  if(posix_rename) {
-    pack_uint8(cmd, SSH_FXP_EXTENDED);
-    pack_uint32(cmd, id);
-    pack_string(cmd, "posix-rename@openssh.org");
-    pack_string(cmd, oldpath);
-    pack_string(cmd, newpath);
-  } else {
-    cmd.reserve(13 + oldpath.size() + newpath.size());
-    pack_uint8(cmd, SSH_FXP_RENAME);
-    pack_uint32(cmd, id);
-    pack_string(cmd, oldpath);
-    pack_string(cmd, newpath);
-  }
+
+  pack_uint8(cmd, SSH_FXP_EXTENDED);
+  pack_uint32(cmd, id);
+  pack_string(cmd, OPENSSH_LIMITS);
   send(cmd);
   out->flush();
+  if(await(id, reply) != SSH_FXP_EXTENDED_REPLY)
+    return;                             // stick with the defaults
+  size_t index = 5;                     // skip type+id
+  unpack_uint64(reply, index);          // max packet length
+  const uint64_t max_read = unpack_uint64(reply, index);
+  const uint64_t max_write = unpack_uint64(reply, index);
+  // A limit of 0 means "unknown"
+  if(max_read)
+    maxread = max_read < SFTP_MAX_REQUEST ? max_read : SFTP_MAX_REQUEST;
+  if(max_write)
+    maxwrite = max_write < SFTP_MAX_REQUEST ? max_write : SFTP_MAX_REQUEST;
+  if(verbose)
+    fprintf(stderr, "SFTP server allows %lu-byte reads, %lu-byte writes\n",
+            (unsigned long)maxread, (unsigned long)maxwrite);
+}
 
-  try {
-    // Synchronously await a reply
-    check("renaming", oldpath, id);
-  } catch(SftpFileError &e) {
-    // posix-rename might not be supported
-    if(posix_rename && e.status == SSH_FX_OP_UNSUPPORTED) {
-      posix_rename = false;
-      rename(oldpath, newpath);
-    } else
-      throw;
-  }
+void SftpFilesystem::rename(const string &oldpath, const string &newpath) {
+  SftpRequest req;
 
+  start_rename(oldpath, newpath, &req);
+  wait(&req);
+  check("renaming", oldpath, req.reply);
 }
 
 void SftpFilesystem::remove(const string &path) {
-  try {
-    unlink(path);
-  } catch(SftpFileError &e) {
-    // unlink failed - perhaps it's a directory
-    if(e.status == SSH_FX_FAILURE)
-      rmdir(path);
-    else
-      throw;
+  SftpRequest req;
+
+  start_remove(path, &req);
+  wait(&req);
+  check("removing", path, req.reply);
+}
+
+void SftpFilesystem::removes(const list<string> &paths) {
+  list<SftpRequest> inflight;
+
+  init();
+  // Keep up to SFTP_REQUEST_WINDOW removes in flight, reporting failures in
+  // the order given
+  list<string>::const_iterator next = paths.begin();
+  list<string>::const_iterator checked = paths.begin();
+  while(checked != paths.end()) {
+    if(next != paths.end() && inflight.size() < SFTP_REQUEST_WINDOW) {
+      inflight.push_back(SftpRequest());
+      start_remove(*next, &inflight.back());
+      ++next;
+      continue;
+    }
+    wait(&inflight.front());
+    try {
+      check("removing", *checked, inflight.front().reply);
+    } catch(FileError &e) {
+      error("%s", e.what());
+    }
+    inflight.pop_front();
+    ++checked;
   }
 }
 
@@ -540,13 +768,7 @@ void SftpFilesystem::unlink(const string &path) {
   init();
 
   // Send the command
-  const uint32_t id = newid();
-  string cmd;
-  cmd.reserve(9 + path.size());
-  pack_uint8(cmd, SSH_FXP_REMOVE);
-  pack_uint32(cmd, id);
-  pack_string(cmd, path);
-  send(cmd);
+  const uint32_t id = sendpath(SSH_FXP_REMOVE, path);
   out->flush();
 
   // Synchronously await a reply
@@ -558,13 +780,7 @@ void SftpFilesystem::rmdir(const string &path) {
   init();
 
   // Send the command
-  const uint32_t id = newid();
-  string cmd;
-  cmd.reserve(9 + path.size());
-  pack_uint8(cmd, SSH_FXP_RMDIR);
-  pack_uint32(cmd, id);
-  pack_string(cmd, path);
-  send(cmd);
+  const uint32_t id = sendpath(SSH_FXP_RMDIR, path);
   out->flush();
 
   // Synchronously await a reply
@@ -599,39 +815,31 @@ void SftpFilesystem::check(const char *what,
 }
 
 File *SftpFilesystem::open(const string &path, OpenMode mode) {
-  init();
+  SftpRequest req;
 
-  // Marshal and send the command
-  string cmd, reply;
-  const uint32_t id = newid();
-  cmd.reserve(17 + path.size());
-  pack_uint8(cmd, SSH_FXP_OPEN);
-  pack_uint32(cmd, id);
-  pack_string(cmd, path);
-  uint32_t m;
-  switch(mode) {
-  case ReadOnly: m = SSH_FXF_READ; break;
-  case Overwrite: m = SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_TRUNC; break;
-  case NoOverwrite: m = SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL; break;
-  default: fatal("invalid open mode %d", (int)mode);
-  }
-  pack_uint32(cmd, m);
-  pack_uint32(cmd, 0);                  // no attrs
-  send(cmd);
-  out->flush();
-  // Await the reply
-  const uint8_t r = await(id, reply);
-  if(r != SSH_FXP_HANDLE) check("opening", path, reply);
+  start_open(path, mode, &req);
+  wait(&req);
+  return opened(path, req);
+}
+
+File *SftpFilesystem::opened(const string &path, const SftpRequest &req) {
+  if((uint8_t)req.reply.at(0) != SSH_FXP_HANDLE)
+    check("opening", path, req.reply);
   size_t index = 5;                     // skip type+id
-  return new SftpFile(this, path, unpack_string(reply, index));
+  return new SftpFile(this, path, unpack_string(req.reply, index));
 }
 
 void SftpFilesystem::mkdir(const string &path, mode_t mode) {
-  // Ensure initialized
-  init();
+  SftpRequest req;
 
-  // Send the command
-  const uint32_t id = newid();
+  start_mkdir(path, mode, &req);
+  wait(&req);
+  check("creating directory", path, req.reply);
+}
+
+uint32_t SftpFilesystem::sendmkdir(const string &path, mode_t mode,
+                                   SftpRequest *callback) {
+  const uint32_t id = newid(callback);
   string cmd;
   cmd.reserve(17 + path.size());
   pack_uint8(cmd, SSH_FXP_MKDIR);
@@ -640,33 +848,152 @@ void SftpFilesystem::mkdir(const string &path, mode_t mode) {
   pack_uint32(cmd, SSH_FILEXFER_ATTR_PERMISSIONS);
   pack_uint32(cmd, mode);
   send(cmd);
-  out->flush();
+  return id;
+}
 
-  // Synchronously await a reply
-  check("creating directory", path, id);
+uint32_t SftpFilesystem::sendpath(uint8_t type, const string &path,
+                                  SftpRequest *callback) {
+  const uint32_t id = newid(callback);
+  string cmd;
+  cmd.reserve(9 + path.size());
+  pack_uint8(cmd, type);
+  pack_uint32(cmd, id);
+  pack_string(cmd, path);
+  send(cmd);
+  return id;
+}
+
+uint32_t SftpFilesystem::sendrename(const string &oldpath,
+                                    const string &newpath,
+                                    SftpRequest *callback) {
+  const uint32_t id = newid(callback);
+  string cmd;
+  cmd.reserve(41 + oldpath.size() + newpath.size());
+  if(posix_rename) {
+    pack_uint8(cmd, SSH_FXP_EXTENDED);
+    pack_uint32(cmd, id);
+    pack_string(cmd, POSIX_RENAME);
+  } else {
+    pack_uint8(cmd, SSH_FXP_RENAME);
+    pack_uint32(cmd, id);
+  }
+  pack_string(cmd, oldpath);
+  pack_string(cmd, newpath);
+  send(cmd);
+  return id;
+}
+
+void SftpFilesystem::makedirs(const string &path) {
+  if(knowndirs.find(path) != knowndirs.end())
+    return;
+  // Try to create every directory not known to exist in one go, rather than
+  // finding out which exist first
+  list<string> missing;
+  for(string::size_type n = 1; n < path.size(); ++n) {
+    if(path[n] == '/') {
+      const string prefix(path, 0, n);
+      if(knowndirs.find(prefix) == knowndirs.end())
+        missing.push_back(prefix);
+    }
+  }
+  missing.push_back(path);
+  mkdirs(missing);
+  knowndirs.insert(missing.begin(), missing.end());
+}
+
+void SftpFilesystem::mkdirs(const list<string> &paths) {
+  typedef pair<uint32_t, const string *> request;
+  list<request> inflight;
+  list<pair<const string *, string> > failed; // paths and MKDIR replies
+  set<string> proven;                   // directories known to exist
+  string reply;
+
+  init();
+  // Send all the MKDIRs, keeping up to SFTP_REQUEST_WINDOW in flight.  The
+  // server handles them in order so parents exist before their children.
+  list<string>::const_iterator next = paths.begin();
+  while(next != paths.end() || inflight.size()) {
+    if(next != paths.end() && inflight.size() < SFTP_REQUEST_WINDOW) {
+      inflight.push_back(request(sendmkdir(*next, 0777), &*next));
+      ++next;
+      continue;
+    }
+    const string &path = *inflight.front().second;
+    await(inflight.front().first, reply);
+    inflight.pop_front();
+    size_t index = 5;                   // skip type+id
+    if((uint8_t)reply[0] == SSH_FXP_STATUS
+       && unpack_uint32(reply, index) == SSH_FX_OK) {
+      // Creating PATH proves that all its parents exist
+      for(string::size_type n = 1; n < path.size(); ++n)
+        if(path[n] == '/')
+          proven.insert(string(path, 0, n));
+    } else {
+      // SFTP v3 has no way to say "already exists", so the failure is
+      // checked below
+      failed.push_back(make_pair(&path, string()));
+      failed.back().second.swap(reply);
+    }
+  }
+  // Failures don't matter if the directory exists anyway
+  list<pair<const string *, string> >::iterator f = failed.begin();
+  while(f != failed.end()) {
+    if(proven.find(*f->first) != proven.end())
+      f = failed.erase(f);
+    else
+      ++f;
+  }
+  list<pair<const string *, string> >::const_iterator check_next
+    = failed.begin();
+  list<pair<const string *, string> >::const_iterator checked
+    = failed.begin();
+  while(checked != failed.end()) {
+    if(check_next != failed.end() && inflight.size() < SFTP_REQUEST_WINDOW) {
+      // STAT, not LSTAT, so that a symlink to a directory will do
+      inflight.push_back(request(sendpath(SSH_FXP_STAT, *check_next->first),
+                                 check_next->first));
+      ++check_next;
+      continue;
+    }
+    const uint8_t r = await(inflight.front().first, reply);
+    inflight.pop_front();
+    size_t index = 5;                   // skip type+id
+    Attributes attrs;
+    if(r == SSH_FXP_ATTRS)
+      unpack_attrs(reply, index, attrs);
+    if(r != SSH_FXP_ATTRS
+       || !(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+       || filetype(attrs.permissions) != Directory) {
+      // Report the MKDIR failure
+      while(inflight.size()) {
+        ignore(inflight.front().first);
+        inflight.pop_front();
+      }
+      check("creating directory", *checked->first, checked->second);
+    }
+    ++checked;
+  }
 }
 
 int SftpFilesystem::exists(const string &path) {
   init();
 
-  // Read any pending existence information
-  while(!existence_inflight.empty()) {
-    const exists_inflight &e = existence_inflight.front();
-    string reply;
-    const uint8_t r = await(e.id, reply);
-    existence[e.path] = (r == SSH_FXP_ATTRS);
-    existence_inflight.pop_front();
+  map<string,int>::iterator it = existence.find(path);
+  if(it == existence.end()) {
+    // No cached information
+    prefigure_exists(path);
+    it = existence.find(path);
   }
-  // Inspect the cache
-  const map<string,bool>::iterator it = existence.find(path);
-  if(it != existence.end()) {
-    const bool e = it->second;
-    existence.erase(it);
-    return e;
+  // Wait for the answer if it's still on its way
+  if(it->second == -1 && exists_batch.size())
+    send_exists_batch();
+  while(it->second == -1) {
+    out->flush();
+    poll();
   }
-  // No cached information
-  prefigure_exists(path);
-  return exists(path);
+  const bool e = it->second;
+  existence.erase(it);
+  return e;
 }
 
 uint32_t SftpFilesystem::closehandle(const string &handle) {
@@ -682,9 +1009,22 @@ uint32_t SftpFilesystem::closehandle(const string &handle) {
 
 void SftpFilesystem::contents(const string &path,
 			      list<string> &c) {
+  list<DirEntry> entries;
+
+  scan(path, entries);
+  c.clear();
+  for(list<DirEntry>::const_iterator it = entries.begin();
+      it != entries.end();
+      ++it)
+    c.push_back(it->name);
+}
+
+void SftpFilesystem::scan(const string &path,
+                          list<DirEntry> &c) {
   // Ensure initialized
   init();
 
+  c.clear();
   // Open the directory
   const uint32_t id = newid();
   string cmd, reply;
@@ -700,11 +1040,12 @@ void SftpFilesystem::contents(const string &path,
   size_t index = 5;                     // skip type+id
   const string handle = unpack_string(reply, index);
   try {
-    cmd.clear();
-    pack_uint8(cmd, SSH_FXP_READDIR);
-    pack_uint32(cmd, id);
-    pack_string(cmd, handle);
     for(;;) {
+      const uint32_t id = newid();
+      cmd.clear();
+      pack_uint8(cmd, SSH_FXP_READDIR);
+      pack_uint32(cmd, id);
+      pack_string(cmd, handle);
       send(cmd);
       out->flush();
       const uint8_t r = await(id, reply);
@@ -716,8 +1057,19 @@ void SftpFilesystem::contents(const string &path,
           const string longname = unpack_string(reply, index);
           Attributes attrs;
           unpack_attrs(reply, index, attrs);
-          if(filename != "." && filename != "..")
-            c.push_back(filename);
+          if(filename != "." && filename != "..") {
+            c.push_back(DirEntry());
+            DirEntry &e = c.back();
+            e.name = filename;
+            // Servers aren't obliged to send any attributes, in which case
+            // the type costs another round trip
+            e.type = (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS
+                      ? filetype(attrs.permissions)
+                      : type(path + "/" + filename));
+            e.size = (attrs.flags & SSH_FILEXFER_ATTR_SIZE ? attrs.size : 0);
+            e.mtime = (attrs.flags & SSH_FILEXFER_ATTR_ACMODTIME
+                       ? attrs.mtime : 0);
+          }
           --count;
         }
       } else {
@@ -733,82 +1085,206 @@ void SftpFilesystem::contents(const string &path,
 }
 
 Filetype SftpFilesystem::type(const string &path) {
-  // Ensure initialized
+  SftpRequest req;
+
+  // SFTP v3 permissions carry the POSIX file type bits too
+  start_lstat(path, &req);
+  wait(&req);
+  if((uint8_t)req.reply.at(0) != SSH_FXP_ATTRS) {
+    check("checking file type", path, req.reply); // raise the exception
+    return UnknownFileType;
+  }
+  size_t index = 5;                     // skip type+id
+  Attributes attrs;
+  unpack_attrs(req.reply, index, attrs);
+  if(!(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS))
+    return UnknownFileType;
+  return filetype(attrs.permissions);
+}
+
+void SftpFilesystem::attributes(const string &path, DirEntry &e) {
+  SftpRequest req;
+
+  start_stat(path, &req);
+  wait(&req);
+  if((uint8_t)req.reply.at(0) != SSH_FXP_ATTRS)
+    check("stat", path, req.reply);     // raise the exception
+  size_t index = 5;                     // skip type+id
+  Attributes attrs;
+  unpack_attrs(req.reply, index, attrs);
+  e.type = (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS
+            ? filetype(attrs.permissions) : UnknownFileType);
+  e.size = (attrs.flags & SSH_FILEXFER_ATTR_SIZE ? attrs.size : 0);
+  e.mtime = (attrs.flags & SSH_FILEXFER_ATTR_ACMODTIME ? attrs.mtime : 0);
+}
+
+bool SftpFilesystem::checkfile(const string &path, uint8_t h[HASH_SIZE]) {
+  init();
+
+  string reply;
+  const map<string, string>::iterator it = prehashed.find(path);
+  if(it != prehashed.end()) {
+    // prefigure_checkfile() has already asked
+    while(it->second.empty()) {
+      out->flush();
+      poll();
+    }
+    reply.swap(it->second);
+    prehashed.erase(it);
+  } else {
+    if(!check_file_name && !check_file_handle)
+      return false;
+    uint32_t id;
+    if(check_file_name)
+      id = sendcheckfile("check-file-name", path);
+    else {
+      // The server can only hash open files
+      SftpRequest req;
+      start_open(path, ReadOnly, &req);
+      wait(&req);
+      if((uint8_t)req.reply.at(0) != SSH_FXP_HANDLE)
+        check("opening", path, req.reply);
+      size_t index = 5;                 // skip type+id
+      const string handle = unpack_string(req.reply, index);
+      id = sendcheckfile("check-file-handle", handle);
+      ignore(closehandle(handle));
+    }
+    await(id, reply);
+  }
+  if((uint8_t)reply.at(0) == SSH_FXP_EXTENDED_REPLY) {
+    size_t index = 5;                   // skip type+id
+    unpack_string(reply, index);        // "check-file"
+    if(unpack_string(reply, index) == HASH_NAME
+       && reply.size() - index == HASH_SIZE) {
+      memcpy(h, reply.data() + index, HASH_SIZE);
+      return true;
+    }
+  } else if(status_is(reply, SSH_FX_NO_SUCH_FILE)
+            || status_is(reply, SSH_FX_PERMISSION_DENIED))
+    check("hashing", path, reply);      // raise the exception
+  // The server can't hash this file (perhaps it doesn't support HASH_NAME),
+  // so stop asking and read files back instead.  Replies to requests already
+  // sent by prefigure_checkfile() may arrive here after that.
+  if(check_file_name || check_file_handle) {
+    if(verbose)
+      fprintf(stderr, "SFTP server cannot hash %s; reading files back\n",
+              path.c_str());
+    check_file_name = check_file_handle = false;
+  }
+  return false;
+}
+
+void SftpFilesystem::prefigure_checkfile(const string &path) {
   init();
 
-  // Ridiculously there does not seem to be a simple way to just get the file
-  // type.  So we sent a bunch of commands and see which succeed, if any, and
-  // deduce the file type from that.
+  // Without check-file-name the file would have to be opened first
+  if(!check_file_name || prehashed.find(path) != prehashed.end())
+    return;
+  prehashed[path];                      // empty until the reply arrives
+  sendcheckfile("check-file-name", path, new CheckFileOp(path));
+  out->flush();
+}
 
+uint32_t SftpFilesystem::sendcheckfile(const char *extension,
+                                       const string &arg,
+                                       SftpRequest *callback) {
+  string cmd;
+  const uint32_t id = newid(callback);
+
+  pack_uint8(cmd, SSH_FXP_EXTENDED);
+  pack_uint32(cmd, id);
+  pack_string(cmd, extension);
+  pack_string(cmd, arg);
+  pack_string(cmd, HASH_NAME);          // the only acceptable algorithm
+  pack_uint64(cmd, 0);                  // from the start...
+  pack_uint64(cmd, 0);                  // ...to the end
+  pack_uint32(cmd, 0);                  // as a single hash
+  send(cmd);
+  return id;
+}
+
+void SftpFilesystem::start_open(const string &path, OpenMode mode,
+                                SftpRequest *req) {
+  init();
+
+  // Marshal and send the command
+  uint32_t m;
+  switch(mode) {
+  case ReadOnly: m = SSH_FXF_READ; break;
+  case Overwrite: m = SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_TRUNC; break;
+  case NoOverwrite: m = SSH_FXF_WRITE|SSH_FXF_CREAT|SSH_FXF_EXCL; break;
+  default: fatal("invalid open mode %d", (int)mode);
+  }
   string cmd;
-  const uint32_t openfileid = newid();
   cmd.reserve(17 + path.size());
   pack_uint8(cmd, SSH_FXP_OPEN);
-  pack_uint32(cmd, openfileid);
+  pack_uint32(cmd, newid(req));
   pack_string(cmd, path);
-  pack_uint32(cmd, SSH_FXF_READ);
+  pack_uint32(cmd, m);
   pack_uint32(cmd, 0);                  // no attrs
   send(cmd);
+}
 
-  cmd.clear();
-  const uint32_t opendirid = newid();
-  pack_uint8(cmd, SSH_FXP_OPENDIR);
-  pack_uint32(cmd, opendirid);
-  pack_string(cmd, path);
-  send(cmd);
+void SftpFilesystem::start_remove(const string &path, SftpRequest *req) {
+  init();
+  sendpath(SSH_FXP_REMOVE, path, new RemoveOp(path, req));
+}
 
-  const uint32_t readlinkid = newid();
-  cmd.clear();
-  pack_uint8(cmd, SSH_FXP_READLINK);
-  pack_uint32(cmd, readlinkid);
-  pack_string(cmd, path);
-  send(cmd);
+void SftpFilesystem::start_rename(const string &oldpath,
+                                  const string &newpath,
+                                  SftpRequest *req) {
+  init();
+  (new RenameOp(oldpath, newpath, req))->send(this);
+}
 
-  out->flush();
+void SftpFilesystem::start_mkdir(const string &path, mode_t mode,
+                                 SftpRequest *req) {
+  init();
+  sendmkdir(path, mode, req);
+}
 
-  // Await the replies
-  string readfilereply, readdirreply, readlinkreply;
-  const uint8_t openfiler = await(openfileid, readfilereply);
-  const uint8_t opendirr = await(opendirid, readdirreply);
-  const uint8_t readlinkr = await(readlinkid, readlinkreply);
-  
-  // Maybe the file doesn't exist
-  if(openfiler == SSH_FXP_STATUS) {
-    size_t index = 5;                   // skip type+id
-    uint32_t status = unpack_uint32(readfilereply, index);
-    if(status == SSH_FX_NO_SUCH_FILE)
-      check("checking file type", path, readfilereply); // raise the exception
-  }
+void SftpFilesystem::start_stat(const string &path, SftpRequest *req) {
+  init();
+  sendpath(SSH_FXP_STAT, path, req);
+}
 
-  // Whichever succeeded tells us the file type
-  Filetype t = UnknownFileType;
-  if(openfiler == SSH_FXP_HANDLE) {
-    t = RegularFile;
-    size_t index = 5;
-    ignore(closehandle(unpack_string(readfilereply, index)));
-  }
-  if(opendirr == SSH_FXP_HANDLE) {
-    t = Directory;
-    size_t index = 5;
-    ignore(closehandle(unpack_string(readdirreply, index)));
+void SftpFilesystem::start_lstat(const string &path, SftpRequest *req) {
+  init();
+  sendpath(SSH_FXP_LSTAT, path, req);
+}
+
+void SftpFilesystem::wait(SftpRequest *req) {
+  while(!req->done) {
+    // The request, or a follow-up that one of its callbacks has just sent,
+    // may still be in our buffer
+    out->flush();
+    poll();
   }
-  if(readlinkr == SSH_FXP_NAME)
-    t = SymbolicLink;
-  return t;
 }
 
 void SftpFilesystem::ignore(uint32_t id) {
-  replies.erase(id);                    // might have been received already
-  ignored.insert(id);
+  Reply *const r = find(id);
+  if(!r)
+    return;
+  if(r->state == Reply::Arrived)
+    release(r);                         // already received
+  else
+    r->state = Reply::Ignored;
 }
 
 uint8_t SftpFilesystem::await(uint32_t id, string &reply) {
-  // Wait for the reply to arrive
-  map<uint32_t, string>::iterator it;
-  while((it = replies.find(id)) == replies.end())
+  Reply *r = find(id);
+  assert(r != 0 && r->state != Reply::Ignored && !r->callback);
+  // Wait for the reply to arrive.  Callbacks run by poll() may send requests
+  // of their own, which can move R, so it is looked up afresh each time.
+  while(r->state != Reply::Arrived) {
+    // The command (or ones it depends on) may still be in our buffer
+    out->flush();
     poll();
-  reply = it->second;
-  replies.erase(it);                    // reply is no longer pending
+    r = find(id);
+  }
+  reply.swap(r->payload);
+  release(r);                           // reply is no longer pending
   return (uint8_t)reply.at(0);          // return the type as a convenience
 }
 
@@ -820,41 +1296,176 @@ void SftpFilesystem::poll() {
   // pick out the ID
   size_t index = 1;                     // skip type
   const uint32_t id = unpack_uint32(reply, index);
-  set<uint32_t>::iterator it;
-
-  if((it = ignored.find(id)) == ignored.end())
+  Reply *const r = find(id);
+  if(!r || r->state == Reply::Arrived)
+    fatal("unexpected SFTP reply to request %lu", (unsigned long)id);
+  if(r->state == Reply::Ignored)
+    release(r);
+  else if(r->callback) {
+    SftpRequest *const callback = r->callback;
+    release(r);
+    callback->complete(this, reply);
+  } else {
     // stash pending reply
-    replies[id] = reply;
-  else
-    // seen ignored reply, forget the ID for now
-    ignored.erase(it);
+    r->payload.swap(reply);
+    r->state = Reply::Arrived;
+  }
 }
   
-bool SftpFilesystem::ready(uint32_t id) const {
-  return replies.find(id) != replies.end();
+bool SftpFilesystem::ready(uint32_t id) {
+  const Reply *const r = find(id);
+  return r && r->state == Reply::Arrived;
+}
+
+SftpFilesystem::Reply *SftpFilesystem::find(uint32_t id) {
+  Reply &r = slots[id % SFTP_REPLY_SLOTS];
+  if(r.state != Reply::Free && r.id == id)
+    return &r;
+  if(overflow.empty())
+    return 0;
+  const map<uint32_t, Reply>::iterator it = overflow.find(id);
+  return it != overflow.end() ? &it->second : 0;
 }
 
-uint32_t SftpFilesystem::newid() { 
+void SftpFilesystem::release(Reply *r) {
+  if(r >= &slots[0] && r < &slots[0] + slots.size()) {
+    r->state = Reply::Free;
+    r->callback = 0;
+    string().swap(r->payload);
+  } else
+    overflow.erase(r->id);
+}
+
+uint32_t SftpFilesystem::newid(SftpRequest *callback) {
   if(!id)
     id++;
-  return id++;
+  const uint32_t n = id++;
+  Reply &r = slots[n % SFTP_REPLY_SLOTS];
+  if(r.state != Reply::Free) {
+    // Some old request is still using the slot; move it out of the way
+    Reply &displaced = overflow[r.id];
+    displaced.id = r.id;
+    displaced.state = r.state;
+    displaced.callback = r.callback;
+    displaced.payload.swap(r.payload);
+  }
+  r.id = n;
+  r.state = Reply::Waiting;
+  r.callback = callback;
+  r.payload.clear();
+  return n;
 }
 
 void SftpFilesystem::prefigure_exists(const string &path) {
   init();
 
-  string cmd;
-  const uint32_t id = newid();
-  assert(id != 0);
-  pack_uint8(cmd, SSH_FXP_STAT);
-  pack_uint32(cmd, id);
-  pack_string(cmd, path);
+  // Don't ask twice
+  if(existence.find(path) != existence.end())
+    return;
+  existence[path] = -1;
+  if(agent_exists) {
+    // Ask about a batch of paths at once.  Collect them while a query is in
+    // flight, but don't hold any back otherwise.
+    exists_batch.push_back(path);
+    while(exists_inflight && in->readable())
+      poll();
+    if(!exists_inflight || exists_batch.size() >= AGENT_EXISTS_BATCH) {
+      send_exists_batch();
+      out->flush();
+    }
+    return;
+  }
+  sendpath(SSH_FXP_STAT, path, new ExistsOp(path));
+  out->flush();
+}
+
+void SftpFilesystem::send_exists_batch() {
+  string cmd, paths;
+  const uint32_t count = exists_batch.size();
+
+  for(vector<string>::const_iterator it = exists_batch.begin();
+      it != exists_batch.end();
+      ++it)
+    pack_string(paths, *it);
+  pack_uint8(cmd, SSH_FXP_EXTENDED);
+  pack_uint32(cmd, newid(new ExistsBatchOp(exists_batch))); // empties batch
+  pack_string(cmd, AGENT_EXISTS);
+  pack_uint32(cmd, count);
+  cmd.append(paths);
+  ++exists_inflight;
   send(cmd);
+}
+
+bool SftpFilesystem::install(const string &path, File *src,
+                             const uint8_t *hash) {
+  init();
+
+  if(!agent_put)
+    return false;
+  check_puts();
+  string chunk;
+  Hash hashctx;
+  uint64_t offset = 0;
+  uint32_t flags = 0;
+  try {
+    // A chunk shorter than maxwrite is the last one, even if it is empty
+    while(!(flags & AGENT_PUT_LAST)) {
+      if((uint32_t)src->getbytes(chunk, maxwrite) < maxwrite)
+        flags |= AGENT_PUT_LAST;
+      if(hash) {
+        hashctx.write(chunk.data(), chunk.size());
+        if((flags & AGENT_PUT_LAST)
+           && memcmp(hashctx.value(), hash, HASH_SIZE))
+          throw FileChanged(path);
+      }
+      sendput(path, offset, flags, chunk);
+      offset += chunk.size();
+    }
+  } catch(...) {
+    // Tell the agent to throw away whatever it has so far
+    sendput(path, offset, AGENT_PUT_ABORT, string());
+    out->flush();
+    throw;
+  }
+  // Don't wait for the replies; check_puts() will find any failure later
   out->flush();
-  existence_inflight.push_back(exists_inflight(id, path));
+  return true;
 }
 
-bool SftpFilesystem::posix_rename = true;
+void SftpFilesystem::finish_installs() {
+  while(puts_inflight) {
+    out->flush();
+    poll();
+  }
+  check_puts();
+}
+
+void SftpFilesystem::sendput(const string &path, uint64_t offset,
+                             uint32_t flags, const string &data) {
+  // Only wait for the agent when the window is full
+  while(puts_inflight >= (size_t)sftp_writes) {
+    out->flush();
+    poll();
+  }
+  string cmd;
+  cmd.reserve(path.size() + 60);
+  pack_uint8(cmd, SSH_FXP_EXTENDED);
+  pack_uint32(cmd, newid(new PutOp(path)));
+  pack_string(cmd, AGENT_PUT);
+  pack_string(cmd, path);
+  pack_uint64(cmd, offset);
+  pack_uint32(cmd, flags);
+  ++puts_inflight;
+  send(cmd, data.data(), data.size());
+}
+
+void SftpFilesystem::check_puts() {
+  if(put_failure.empty())
+    return;
+  string reply;
+  reply.swap(put_failure);
+  check("installing", put_failure_path, reply);
+}
 
 /*
 Local Variables:
@@ -0,0 +1,213 @@
+/*
+ * This file is part of hbackup.
+ * Copyright (C) 2006, 2007 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+#ifndef SFTP_H
+#define SFTP_H
+
+// SFTP protocol definitions and marshalling, shared by the client in sftp.cc
+// and the server in agent.cc
+
+// packets types from draft-ietf-secsh-filexfer-02.txt 3
+static const uint8_t SSH_FXP_INIT                =1;
+static const uint8_t SSH_FXP_VERSION             =2;
+static const uint8_t SSH_FXP_OPEN                =3;
+static const uint8_t SSH_FXP_CLOSE               =4;
+static const uint8_t SSH_FXP_READ                =5;
+static const uint8_t SSH_FXP_WRITE               =6;
+static const uint8_t SSH_FXP_LSTAT               =7;
+static const uint8_t SSH_FXP_FSTAT               =8;
+static const uint8_t SSH_FXP_SETSTAT             =9;
+static const uint8_t SSH_FXP_FSETSTAT           =10;
+static const uint8_t SSH_FXP_OPENDIR            =11;
+static const uint8_t SSH_FXP_READDIR            =12;
+static const uint8_t SSH_FXP_REMOVE             =13;
+static const uint8_t SSH_FXP_MKDIR              =14;
+static const uint8_t SSH_FXP_RMDIR              =15;
+static const uint8_t SSH_FXP_REALPATH           =16;
+static const uint8_t SSH_FXP_STAT               =17;
+static const uint8_t SSH_FXP_RENAME             =18;
+static const uint8_t SSH_FXP_READLINK           =19;
+static const uint8_t SSH_FXP_SYMLINK            =20;
+static const uint8_t SSH_FXP_STATUS            =101;
+static const uint8_t SSH_FXP_HANDLE            =102;
+static const uint8_t SSH_FXP_DATA              =103;
+static const uint8_t SSH_FXP_NAME              =104;
+static const uint8_t SSH_FXP_ATTRS             =105;
+static const uint8_t SSH_FXP_EXTENDED          =200;
+static const uint8_t SSH_FXP_EXTENDED_REPLY    =201;
+
+// OpenSSH extensions.  The client and server must spell these the same way.
+#define POSIX_RENAME "posix-rename@openssh.com"
+#define OPENSSH_LIMITS "limits@openssh.com"
+
+// extensions offered by nhbackup --agent (see agent.cc)
+#define AGENT_EXISTS "exists@hbackup.greenend.org.uk"
+#define AGENT_PUT "put@hbackup.greenend.org.uk"
+
+// AGENT_PUT flags
+static const uint32_t AGENT_PUT_LAST          =0x00000001;
+static const uint32_t AGENT_PUT_ABORT         =0x00000002;
+
+// attribute flag bits from draft-ietf-secsh-filexfer-02.txt 5
+static const uint32_t SSH_FILEXFER_ATTR_SIZE          =0x00000001;
+static const uint32_t SSH_FILEXFER_ATTR_UIDGID        =0x00000002;
+static const uint32_t SSH_FILEXFER_ATTR_PERMISSIONS   =0x00000004;
+static const uint32_t SSH_FILEXFER_ATTR_ACMODTIME     =0x00000008;
+static const uint32_t SSH_FILEXFER_ATTR_EXTENDED      =0x80000000;
+
+// pflags from draft-ietf-secsh-filexfer-02.txt 6.3
+static const uint32_t SSH_FXF_READ            =0x00000001;
+static const uint32_t SSH_FXF_WRITE           =0x00000002;
+static const uint32_t SSH_FXF_APPEND          =0x00000004;
+static const uint32_t SSH_FXF_CREAT           =0x00000008;
+static const uint32_t SSH_FXF_TRUNC           =0x00000010;
+static const uint32_t SSH_FXF_EXCL            =0x00000020;
+
+// status codes from draft-ietf-secsh-filexfer-02.txt 7
+static const uint32_t SSH_FX_OK                            =0;
+static const uint32_t SSH_FX_EOF                           =1;
+static const uint32_t SSH_FX_NO_SUCH_FILE                  =2;
+static const uint32_t SSH_FX_PERMISSION_DENIED             =3;
+static const uint32_t SSH_FX_FAILURE                       =4;
+static const uint32_t SSH_FX_BAD_MESSAGE                   =5;
+static const uint32_t SSH_FX_NO_CONNECTION                 =6;
+static const uint32_t SSH_FX_CONNECTION_LOST               =7;
+static const uint32_t SSH_FX_OP_UNSUPPORTED                =8;
+
+struct Status {
+  uint32_t status;
+  string message;
+  string lang;
+};
+
+struct Attributes {
+  uint32_t flags;
+  uint64_t size;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t permissions;
+  uint32_t atime;
+  uint32_t mtime;
+  map<string, string> extended;
+};
+
+static inline void pack_uint8(string &s, uint8_t byte) {
+  s += (char)byte;
+}
+
+static inline void pack_uint32(string &s, uint32_t u) {
+  pack_uint8(s, (uint8_t)(u >> 24));
+  pack_uint8(s, (uint8_t)(u >> 16));
+  pack_uint8(s, (uint8_t)(u >> 8));
+  pack_uint8(s, (uint8_t)u);
+}
+
+static inline void pack_uint64(string &s, uint64_t u) {
+  pack_uint8(s, (uint8_t)(u >> 56));
+  pack_uint8(s, (uint8_t)(u >> 48));
+  pack_uint8(s, (uint8_t)(u >> 40));
+  pack_uint8(s, (uint8_t)(u >> 32));
+  pack_uint8(s, (uint8_t)(u >> 24));
+  pack_uint8(s, (uint8_t)(u >> 16));
+  pack_uint8(s, (uint8_t)(u >> 8));
+  pack_uint8(s, (uint8_t)(u));
+}
+
+static inline void pack_string(string &s, const string &t) {
+  pack_uint32(s, (uint32_t)t.size());
+  s += t;
+}
+
+static inline uint8_t unpack_uint8(const string &s, size_t &index) {
+  return s.at(index++);
+}
+
+static inline uint32_t unpack_uint32(const string &s, size_t &index) {
+  uint32_t n;
+
+  n = (uint32_t)unpack_uint8(s, index) << 24;
+  n += (uint32_t)unpack_uint8(s, index) << 16;
+  n += (uint32_t)unpack_uint8(s, index) << 8;
+  n += (uint32_t)unpack_uint8(s, index);
+  return n;
+}
+
+static inline uint64_t unpack_uint64(const string &s, size_t &index) {
+  uint64_t n;
+
+  n = (uint64_t)unpack_uint8(s, index) << 56;
+  n += (uint64_t)unpack_uint8(s, index) << 48;
+  n += (uint64_t)unpack_uint8(s, index) << 40; 
+  n += (uint64_t)unpack_uint8(s, index) << 32;
+  n += (uint64_t)unpack_uint8(s, index) << 24;
+  n += (uint64_t)unpack_uint8(s, index) << 16;
+  n += (uint64_t)unpack_uint8(s, index) << 8;
+  n += (uint64_t)unpack_uint8(s, index);
+  return n;
+}
+
+static inline string unpack_string(const string &s, size_t &index) {
+  uint32_t len = unpack_uint32(s, index);
+
+  index += len;
+  return string(s, index - len, len);
+}
+
+static inline void unpack_status(const string &s, size_t &index, Status &st) {
+  st.status = unpack_uint32(s, index);
+  st.message = unpack_string(s, index);
+  st.lang = unpack_string(s, index);
+}
+
+static inline void unpack_attrs(const string &s, size_t &index, Attributes &attrs) {
+  attrs.flags = unpack_uint32(s, index);
+  if(attrs.flags & SSH_FILEXFER_ATTR_SIZE)
+    attrs.size = unpack_uint64(s, index);
+  if(attrs.flags & SSH_FILEXFER_ATTR_UIDGID) {
+    attrs.uid = unpack_uint32(s, index);
+    attrs.gid = unpack_uint32(s, index);
+  }
+  if(attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+    attrs.permissions = unpack_uint32(s, index);
+  if(attrs.flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+    attrs.atime = unpack_uint32(s, index);
+    attrs.mtime = unpack_uint32(s, index);
+  }
+  if(attrs.flags & SSH_FILEXFER_ATTR_EXTENDED) {
+    uint32_t count = unpack_uint32(s, index);
+    while(count > 0) {
+      const string k = unpack_string(s, index);
+      const string v = unpack_string(s, index);
+      attrs.extended[k] = v;
+      --count;
+    }
+  }
+}
+
+#endif /* SFTP_H */
+
+/*
+Local Variables:
+mode:c++
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
@@ -0,0 +1,62 @@
+/*
+ * This file is part of hbackup.
+ * Copyright (C) 2009 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+
+// A stand-in SFTP server for the test suite.  Like OpenSSH's sftp-server it
+// serves the local filesystem over stdin and stdout; it is the server half of
+// nhbackup --agent (see agent.cc), but by default it only offers the
+// extensions that real SFTP servers do, plus check-file-name and
+// check-file-handle, which OpenSSH lacks.
+//
+// If SFTPSTUB_EXTENSIONS is set, the extensions it lists (separated by
+// commas) are advertised instead.  It may name the agent's extensions.
+//
+// If SFTPSTUB_EXTENDED_ATTRS is set, file attributes include some extended
+// attributes, as some servers send.
+//
+// Like sftp-server it rejects options it doesn't know, which is all of them,
+// so the tests can use it as a --remote-agent that turns out not to be an
+// agent.
+
+#include "nhbackup.h"
+
+int main(int argc, char **argv) {
+  const char *extensions = getenv("SFTPSTUB_EXTENSIONS");
+
+  if(argc > 1) {
+    fprintf(stderr, "%s: invalid option '%s'\n", argv[0], argv[1]);
+    exit(1);
+  }
+
+  if(!extensions)
+    extensions = ("posix-rename@openssh.com,limits@openssh.com,"
+                  "check-file-name,check-file-handle");
+  sftp_serve(extensions, getenv("SFTPSTUB_EXTENDED_ATTRS") != 0);
+  return 0;
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/
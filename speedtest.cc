@@ -31,6 +31,27 @@ static void report(const timeval *start,
   printf("%s: %g\n", what, (e - s) / count);
 }
 
+// A file that discards what is written to it
+class SinkFile : public File {
+  void writebytes(const void *, int) {}
+};
+
+// A file that reads the same text over and over
+class RepeatFile : public File {
+  const string text;
+public:
+  RepeatFile(const string &text_): text(text_) {}
+private:
+  int readbytes(void *buf, int space) {
+    int n = 0;
+    while(space - n >= (int)text.size()) {
+      memcpy((char *)buf + n, text.data(), text.size());
+      n += text.size();
+    }
+    return n;
+  }
+};
+
 void do_speedtest() {
   {
     map<string,string> l;
@@ -45,6 +66,29 @@ void do_speedtest() {
     hexencode(bytes, sizeof bytes);
     end();
   }
+  {
+    static const uint8_t bytes[40] = {};
+    char buffer[80];
+    begin(hexencodebuffer, 1000000);
+    hexencode(buffer, bytes, sizeof bytes);
+    end();
+  }
+  {
+    static const uint8_t h[HASH_SIZE] = {
+      0xb3, 0x5b, 0x20, 0xb2, 0x50, 0xf4, 0x70, 0xec, 0xa9, 0xbd,
+      0x7e, 0x41, 0x82, 0x16, 0x87, 0x23, 0x3d, 0x36, 0x6b, 0x40
+    };
+    begin(hashpath, 1000000);
+    hashpath(h);
+    end();
+  }
+  {
+    static const string s = "b35b20b250f470eca9bd7e41821687233d366b40";
+    uint8_t h[HASH_SIZE];
+    begin(hashdecode, 1000000);
+    hashdecode(s, h);
+    end();
+  }
   {
     static const string s1 = "b35b20b250f470eca9bd7e41821687233d366b40";
     begin(urlencode1, 1000000);
@@ -57,6 +101,83 @@ void do_speedtest() {
     urlencode(s2);
     end();
   }    
+  {
+    static const string s3 = "home/someone/Documents/Projects/hbackup/build/a-rather-long-directory-name/with/several/levels/of/nesting/before-we-get-to-the-file-itself.tar.gz";
+    begin(urlencodelong, 1000000);
+    urlencode(s3);
+    end();
+  }
+  {
+    string s4(256, 0);                  // backup.cc's STORE_LIMIT
+    for(size_t n = 0; n < s4.size(); ++n)
+      s4[n] = (char)(n * 37 + 11);
+    begin(urlencodebinary, 1000000);
+    urlencode(s4);
+    end();
+  }
+  {
+    static const string s3 = urlencode("home/someone/Documents/Projects/hbackup/build/a-rather-long-directory-name/with/several/levels/of/nesting/before-we-get-to-the-file-itself.tar.gz");
+    begin(urldecodelong, 1000000);
+    urldecode(s3);
+    end();
+  }
+  {
+    string s4(256, 0);                  // backup.cc's STORE_LIMIT
+    for(size_t n = 0; n < s4.size(); ++n)
+      s4[n] = (char)(n * 37 + 11);
+    s4 = urlencode(s4);
+    begin(urldecodebinary, 1000000);
+    urldecode(s4);
+    end();
+  }
+  {
+    static const string s = "name=share%2Fzoneinfo%2Fright%2FZulu&perms=0644&uid=root&gid=root&atime=1145439807&ctime=1145439831&mtime=1143984233&sha1=b35b20b250f470eca9bd7e41821687233d366b40\n";
+    SinkFile f;
+    begin(putline, 1000000);
+    f.put(s);
+    end();
+    f.flush();
+  }
+  {
+    static const string name = "share/zoneinfo/right/Zulu";
+    static const uint8_t h[HASH_SIZE] = {};
+    SinkFile f;
+    begin(formatline, 1000000);
+    f.put("name=");
+    f.puturl(name);
+    f.put("&perms=");
+    f.putoctal(0644);
+    f.put("&uid=");
+    f.puturl(uid2string(0));
+    f.put("&gid=");
+    f.puturl(gid2string(0));
+    f.put("&atime=");
+    f.putu(1145439807);
+    f.put("&ctime=");
+    f.putu(1145439831);
+    f.put("&mtime=");
+    f.putu(1143984233);
+    f.put("&" HASH_NAME "=");
+    f.puthex(h, HASH_SIZE);
+    f.put('\n');
+    end();
+    f.flush();
+  }
+  {
+    static const string s(1024 * 1024, 'x');
+    SinkFile f;
+    begin(putbig, 1000);
+    f.put(s);
+    end();
+    f.flush();
+  }
+  {
+    RepeatFile f("name=share%2Fzoneinfo%2Fright%2FZulu&perms=0644&uid=root&gid=root&atime=1145439807&ctime=1145439831&mtime=1143984233&sha1=b35b20b250f470eca9bd7e41821687233d366b40\n");
+    string line;
+    begin(getline, 1000000);
+    f.getline(line);
+    end();
+  }
 }
 
 /*
@@ -18,6 +18,9 @@
  * USA
  */
 #include "nhbackup.h"
+#if __SSE2__
+# include <emmintrin.h>
+#endif
 
 static const char hexdigits[] = "0123456789abcdef";
 
@@ -37,30 +40,73 @@ void fatal(const char *msg, ...) {
   abort();
 }
 
+// Per-thread destination for diverted messages
+static pthread_key_t diversion_key;
+static pthread_once_t diversion_once = PTHREAD_ONCE_INIT;
+
+static void diversion_init() {
+  if(pthread_key_create(&diversion_key, 0))
+    fatal("pthread_key_create failed");
+}
+
+void divert_messages(list<DivertedMessage> *messages) {
+  pthread_once(&diversion_once, diversion_init);
+  if(pthread_setspecific(diversion_key, messages))
+    fatal("pthread_setspecific failed");
+}
+
+// Report a warning or error, or save it if this thread's messages are
+// diverted.  Returns true if it was reported.
+static bool report(bool iserror, const char *msg, va_list ap) {
+  list<DivertedMessage> *diverted = 0;
+
+  pthread_once(&diversion_once, diversion_init);
+  if((diverted = (list<DivertedMessage> *)pthread_getspecific(diversion_key))) {
+    char *s;
+
+    if(vasprintf(&s, msg, ap) < 0)
+      fatal("error calling vasprintf: %s", strerror(errno));
+    diverted->push_back(DivertedMessage(iserror, s));
+    free(s);
+    return false;
+  }
+  fprintf(stderr, iserror ? "ERROR: " : "WARNING: ");
+  vfprintf(stderr, msg, ap);
+  fputc('\n', stderr);
+  return true;
+}
+
 void warning(const char *msg, ...) {
   va_list ap;
-  fprintf(stderr, "WARNING: ");
   va_start(ap, msg);
-  vfprintf(stderr, msg, ap);
+  if(report(false, msg, ap))
+    ++warnings;
   va_end(ap);
-  fputc('\n', stderr);
-  ++warnings;
 }
 
 void error(const char *msg, ...) {
   va_list ap;
-  fprintf(stderr, "ERROR: ");
   va_start(ap, msg);
-  vfprintf(stderr, msg, ap);
+  if(report(true, msg, ap))
+    ++errors;
   va_end(ap);
-  fputc('\n', stderr);
-  ++errors;
+}
+
+void replay_messages(const list<DivertedMessage> &messages) {
+  for(list<DivertedMessage>::const_iterator it = messages.begin();
+      it != messages.end();
+      ++it) {
+    if(it->iserror)
+      error("%s", it->text.c_str());
+    else
+      warning("%s", it->text.c_str());
+  }
 }
 
 static map<uid_t, string> uid2names;
 static map<gid_t, string> gid2names;
 
-string uid2string(uid_t uid) {
+const string &uid2string(uid_t uid) {
   const map<uid_t, string>::const_iterator it = uid2names.find(uid);
   if(it != uid2names.end()) return it->second;
   const struct passwd *const pw = getpwuid(uid);
@@ -76,7 +122,7 @@ string uid2string(uid_t uid) {
   return uid2names[uid];
 }
 
-string gid2string(gid_t gid) {
+const string &gid2string(gid_t gid) {
   const map<gid_t, string>::const_iterator it = gid2names.find(gid);
   if(it != gid2names.end()) return it->second;
   const struct group *const gr = getgrgid(gid);
@@ -152,48 +198,128 @@ static inline int hexdigit(unsigned char c) {
   else throw BadHexDigit();
 }
 
-string hexencode(const uint8_t *h, size_t len) {
-  string s;
-
-  s.reserve(len * 2);
+char *hexencode(char *out, const uint8_t *h, size_t len) {
+#if __SSE2__
+  // 16 bytes at a time: split into nibbles, interleave them, and map 0-9 and
+  // 10-15 to their digits
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  while(len >= 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)h);
+    const __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    const __m128i lo = _mm_and_si128(v, mask);
+    __m128i a = _mm_unpacklo_epi8(hi, lo), b = _mm_unpackhi_epi8(hi, lo);
+    a = _mm_add_epi8(_mm_add_epi8(a, _mm_set1_epi8('0')),
+                     _mm_and_si128(_mm_cmpgt_epi8(a, _mm_set1_epi8(9)),
+                                   _mm_set1_epi8('a' - '0' - 10)));
+    b = _mm_add_epi8(_mm_add_epi8(b, _mm_set1_epi8('0')),
+                     _mm_and_si128(_mm_cmpgt_epi8(b, _mm_set1_epi8(9)),
+                                   _mm_set1_epi8('a' - '0' - 10)));
+    _mm_storeu_si128((__m128i *)out, a);
+    _mm_storeu_si128((__m128i *)(out + 16), b);
+    out += 32;
+    h += 16;
+    len -= 16;
+  }
+#endif
   for(size_t n = 0; n < len; ++n) {
-    s += hexdigits[h[n] >> 4];
-    s += hexdigits[h[n] & 0x0F];
+    *out++ = hexdigits[h[n] >> 4];
+    *out++ = hexdigits[h[n] & 0x0F];
   }
+  return out;
+}
+
+string hexencode(const uint8_t *h, size_t len) {
+  string s(len * 2, 0);
+
+  hexencode(&s[0], h, len);
   return s;
 }
 
+// How urlencode() treats each byte: 0 to copy it, 1 for space (which becomes
+// +) and 2 to escape it.  Escaped bytes are controls, non-ASCII, and
+// + % & = ; (the last because python's urldecoder splits on it(!)).
+static const unsigned char urlclass[256] = {
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  1, 0, 0, 0, 0, 2, 2, 0, 0, 0, 0, 2, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 2, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+};
+
+// url-encode one byte
+static inline char *urlencode_byte(char *out, unsigned char c) {
+  switch(urlclass[c]) {
+  case 0:
+    *out++ = c;
+    break;
+  case 1:
+    *out++ = '+';
+    break;
+  default:
+    *out++ = '%';
+    *out++ = hexdigits[c >> 4];
+    *out++ = hexdigits[c & 0x0F];
+    break;
+  }
+  return out;
+}
+
+#if __SSE2__
+// Return a bitmap of the bytes in V that urlencode() must change
+static inline int urlunsafe(__m128i v) {
+  // Bytes from 0x80 up are negative, so fail the range test
+  const __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(' ')),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8(127)));
+  const __m128i special =
+    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8('%'))),
+                 _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                                           _mm_cmpeq_epi8(v, _mm_set1_epi8('='))),
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8(';'))));
+  return ~_mm_movemask_epi8(_mm_andnot_si128(special, printable)) & 0xFFFF;
+}
+#endif
+
+// url-encode LEN bytes at S into OUT, which must have room for 3 * LEN
+// bytes.  Returns a pointer to just after the last byte written.
+char *urlencode(char *out, const char *s, size_t len) {
+  const char *const end = s + len;
+
+#if __SSE2__
+  // Copy runs of 16 bytes that need no escaping in one go
+  while(end - s >= 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)s);
+    if(!urlunsafe(v)) {
+      _mm_storeu_si128((__m128i *)out, v);
+      out += 16;
+    } else
+      for(int n = 0; n < 16; ++n)
+        out = urlencode_byte(out, s[n]);
+    s += 16;
+  }
+#endif
+  while(s < end)
+    out = urlencode_byte(out, *s++);
+  return out;
+}
+
 // url-encode a string
 string urlencode(const string &s) {
-  string r;
-  size_t n = 0;
-  const size_t limit = s.size();
-  unsigned char c;
-
-  r.reserve(3 * limit);
-  while(n < limit) {
-    switch(c = s[n++]) {
-    case ' ':
-      r += '+';
-      break;
-    default:
-      if(c < 32 || c > 126) {
-      case '+':
-      case '%':
-      case '&':
-      case '=':
-      case ';':
-        // ; because python's urldecoder splits on it(!)
-        r += '%';
-        r += hexdigits[c >> 4];
-        r += hexdigits[c & 0x0F];
-        break;
-      } else {
-        r += c;
-      }
-      break;
-    }
-  }
+  string r(3 * s.size(), 0);
+
+  if(s.size())
+    r.resize(urlencode(&r[0], s.data(), s.size()) - &r[0]);
   return r;
 }
 
@@ -201,31 +327,53 @@ string urlencode(const string &s) {
 string urldecode(const string &s, 
                  size_t start,
                  size_t end) {
-  string r;
-  size_t n = start;
   const size_t limit = end == string::npos ? s.size() : end;
+  string r(limit - start, 0);
+  const char *in = s.data() + start, *const inend = s.data() + limit;
+  char *out = &r[0];
   
   try {
-    r.reserve(limit - start);
-    while(n < limit) {
-      switch(s[n]) {
+    while(in < inend) {
+      switch(*in) {
       case '+':
-        r += ' ';
-        ++n; 
+        *out++ = ' ';
+        ++in;
         break;
       case '%':
-        if(n + 2 < end) {
-          r += (char)(16 * hexdigit(s[n + 1]) + hexdigit(s[n + 2]));
-          n += 3;
+        if(inend - in > 2) {
+          *out++ = (char)(16 * hexdigit(in[1]) + hexdigit(in[2]));
+          in += 3;
         } else
-          throw BadHex(s.substr(n, limit - n));
+          throw BadHex(string(in, inend));
         break;
       default:
-        r += s[n];
-        ++n;
+#if __SSE2__
+        // Copy runs of 16 bytes that need no decoding in one go
+        while(inend - in >= 16) {
+          const __m128i v = _mm_loadu_si128((const __m128i *)in);
+          const int special =
+            _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+                                           _mm_cmpeq_epi8(v, _mm_set1_epi8('%'))));
+          if(special) {
+            const int n = __builtin_ctz(special);
+            memcpy(out, in, n);
+            out += n;
+            in += n;
+            break;
+          }
+          _mm_storeu_si128((__m128i *)out, v);
+          out += 16;
+          in += 16;
+        }
+        if(in < inend && *in != '+' && *in != '%')
+          *out++ = *in++;
+#else
+        *out++ = *in++;
+#endif
         break;
       }
     }
+    r.resize(out - &r[0]);
     return r;
   } catch(...) {
     error("invalid URL-encoded string: %s", s.c_str());
@@ -233,6 +381,55 @@ string urldecode(const string &s,
   }
 }
 
+#if __SSE2__
+// Convert 16 hex digits at IN to their values, or return false if any of them
+// aren't hex digits
+static inline bool hexdigits16(const char *in, __m128i &values) {
+  const __m128i v = _mm_loadu_si128((const __m128i *)in);
+  // d < 10 for digits, l < 6 for letters (either case)
+  const __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  const __m128i l = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)),
+                                 _mm_set1_epi8('a'));
+  const __m128i isdigit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+  const __m128i isletter = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)),
+                                          l);
+  if(_mm_movemask_epi8(_mm_or_si128(isdigit, isletter)) != 0xFFFF)
+    return false;
+  values = _mm_or_si128(_mm_and_si128(isdigit, d),
+                        _mm_andnot_si128(isdigit,
+                                         _mm_add_epi8(l, _mm_set1_epi8(10))));
+  return true;
+}
+
+// Combine pairs of nibbles into bytes
+static inline __m128i hexpairs(__m128i values) {
+  return _mm_and_si128(_mm_or_si128(_mm_slli_epi16(values, 4),
+                                    _mm_srli_epi16(values, 8)),
+                       _mm_set1_epi16(0x00FF));
+}
+#endif
+
+// Decode 2 * NBYTES hex digits at IN into OUT.  Throws BadHexDigit if any of
+// them aren't hex digits.
+static void hexdecode(const char *in, size_t nbytes, uint8_t *out) {
+#if __SSE2__
+  while(nbytes >= 16) {
+    __m128i a, b;
+    if(!hexdigits16(in, a) || !hexdigits16(in + 16, b))
+      break;                            // let the slow path complain
+    _mm_storeu_si128((__m128i *)out,
+                     _mm_packus_epi16(hexpairs(a), hexpairs(b)));
+    in += 32;
+    out += 16;
+    nbytes -= 16;
+  }
+#endif
+  for(size_t n = nbytes; n > 0; --n) {
+    const int a = hexdigit(*in++) * 16;
+    *out++ = (uint8_t)(a + hexdigit(*in++));
+  }
+}
+
 void hexdecode(const string &hex, string &bytes) {
   const size_t len = hex.size();
 
@@ -240,12 +437,9 @@ void hexdecode(const string &hex, string &bytes) {
     if(len % 2 != 0)
       throw BadHex(hex);
     const size_t nbytes = len / 2;
-    bytes.reserve(nbytes);
-    const char *in = &hex[0];
-    for(size_t n = nbytes; n > 0; --n) {
-      const int a = hexdigit(*in++) * 16;
-      bytes += (char)(a + hexdigit(*in++));
-    }
+    bytes.resize(nbytes);
+    if(nbytes)
+      hexdecode(hex.data(), nbytes, (uint8_t *)&bytes[0]);
   } catch(...) {
     // if something went wrong report the whole string
     error("invalid hex string: %s", hex.c_str());
@@ -254,23 +448,42 @@ void hexdecode(const string &hex, string &bytes) {
 }
 
 void hashdecode(const string &hex, uint8_t h[HASH_SIZE]) {
-  string s;
-
-  if(hex.size() != 40)
+  if(hex.size() != 2 * HASH_SIZE)
     throw BadHex(hex);
-  hexdecode(hex, s);
-  memcpy(h, s.data(), HASH_SIZE);
+  try {
+    hexdecode(hex.data(), HASH_SIZE, h);
+  } catch(...) {
+    error("invalid hex string: %s", hex.c_str());
+    throw;
+  }
+}
+
+// Write the path for H to OUT, which must have room for HASHPATH_SIZE bytes.
+// Returns a pointer to just after the last byte written.
+char *hashpath(char *out, const uint8_t *h) {
+  for(int n = 0; n < DEPTH; ++n) {
+    *out++ = hexdigits[h[n] >> 4];
+    *out++ = hexdigits[h[n] & 0x0F];
+    *out++ = '/';
+  }
+  return hexencode(out, h, HASH_SIZE);
 }
 
 // Return the path for H
 string hashpath(const uint8_t *h) {
-  char buffer[3 * DEPTH + 2 * HASH_SIZE + 1];
+  char buffer[HASHPATH_SIZE];
+
+  return string(buffer, hashpath(buffer, h));
+}
+
+// Set PATH to the full path of the object for H.  PATH's existing storage is
+// reused, so calling this repeatedly with the same string doesn't allocate.
+void objectpath(string &path, const uint8_t *h) {
+  char buffer[HASHPATH_SIZE];
 
-  for(int n = 0; n < DEPTH; ++n)
-    snprintf(buffer + 3 * n, 4, "%02x/", h[n]);
-  for(int n = 0; n < HASH_SIZE; ++n)
-    snprintf(buffer + 3 * DEPTH + 2 * n, 3, "%02x", h[n]);
-  return buffer;
+  path.assign(repo);
+  path.append("/" HASH_NAME "/");
+  path.append(buffer, hashpath(buffer, h));
 }
 
 // Parse an index line.
@@ -307,6 +520,73 @@ const string *getdetail(const map<string,string> &details,
   return it != details.end() ? &it->second : 0;
 }
 
+// Return true if KEY is an index detail that can change without the file
+// changing, as reading a file does to its atime
+bool volatile_detail(const string &key) {
+  return key == "atime" || key == "ctime";
+}
+
+// Return the end of the index field starting at POS in TEXT.  Fields start at
+// the beginning of a line or at an '&'; a newline is a field of its own.
+static size_t field_end(const string &text, size_t pos) {
+  if(text[pos] == '\n')
+    return pos + 1;
+  const size_t end = text.find_first_of("&\n", pos + 1);
+  return end == string::npos ? text.size() : end;
+}
+
+// Return true if the field starting at POS in TEXT is a volatile detail
+static bool volatile_field(const string &text, size_t pos) {
+  if(text[pos] != '&')
+    return false;                       // name, or end of line
+  const size_t eq = text.find('=', pos);
+  return eq != string::npos && volatile_detail(text.substr(pos + 1,
+                                                           eq - pos - 1));
+}
+
+// Return true if A and B, each some whole index lines, differ at most in
+// volatile details
+bool same_index_text(const string &a, const string &b) {
+  size_t apos = 0, bpos = 0;
+
+  if(a == b)
+    return true;
+  for(;;) {
+    while(apos < a.size() && volatile_field(a, apos))
+      apos = field_end(a, apos);
+    while(bpos < b.size() && volatile_field(b, bpos))
+      bpos = field_end(b, bpos);
+    if(apos == a.size() || bpos == b.size())
+      return apos == a.size() && bpos == b.size();
+    const size_t aend = field_end(a, apos), bend = field_end(b, bpos);
+    if(a.compare(apos, aend - apos, b, bpos, bend - bpos))
+      return false;
+    apos = aend;
+    bpos = bend;
+  }
+}
+
+// Compare two directory names in the order that backup_dir() visits them,
+// i.e. component by component, with a directory before its subdirectories.
+// The root directory is "".
+int compare_dirs(const string &a, const string &b) {
+  size_t apos = 0, bpos = 0;
+  const size_t alen = a.size(), blen = b.size();
+
+  for(;;) {
+    if(apos >= alen || bpos >= blen)
+      return (apos < alen) - (bpos < blen);
+    size_t aend = a.find('/', apos), bend = b.find('/', bpos);
+    if(aend == string::npos) aend = alen;
+    if(bend == string::npos) bend = blen;
+    const int c = a.compare(apos, aend - apos, b, bpos, bend - bpos);
+    if(c)
+      return c;
+    apos = aend + 1;
+    bpos = bend + 1;
+  }
+}
+
 
 /*
 Local Variables:
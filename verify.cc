@@ -21,12 +21,128 @@
 
 // Verify ---------------------------------------------------------------------
 
+// An object waiting to be checked
+struct PendingObject {
+  string name;                          // file it was backed up from, if known
+  string path;                          // path in repository
+  uint8_t h[HASH_SIZE];                 // expected hash
+};
+
+// In a remote repository objects are checked SFTP_REQUEST_WINDOW behind the
+// traversal, so that the server can be hashing the ones in between.  Local
+// objects are checked straight away.
+static list<PendingObject> pending;
+static size_t npending;
+
+// Check that object O has the hash it should
+static void check_object(const PendingObject &o) {
+  uint8_t actual_hash[HASH_SIZE];
+
+  try {
+    hashfile(backupfs, o.path, actual_hash);
+  } catch(FileError &e) {
+    if(o.name.empty() || e.error() != ENOENT)
+      throw;
+    error("%s: cannot find %s", o.name.c_str(), o.path.c_str());
+    return;
+  }
+  if(dropcache)
+    backupfs->uncache(o.path);
+  if(memcmp(o.h, actual_hash, HASH_SIZE)) {
+    if(o.name.empty())
+      error("hash mismatch for %s", o.path.c_str());
+    else
+      error("%s: hash mismatch for %s", o.name.c_str(), o.path.c_str());
+    if(detectbogus)
+      backupfs->remove(o.path);
+  }
+}
+
+// Check the object at PATH, which should have hash H, soon.  NAME is the file
+// it was backed up from, or empty if not known.
+static void verify_object(const string &name, const string &path,
+                          const uint8_t h[HASH_SIZE]) {
+  PendingObject o;
+
+  o.name = name;
+  o.path = path;
+  memcpy(o.h, h, HASH_SIZE);
+  if(backupfs == &local) {
+    check_object(o);
+    return;
+  }
+  backupfs->prefigure_checkfile(path);
+  pending.push_back(o);
+  if(++npending > SFTP_REQUEST_WINDOW) {
+    check_object(pending.front());
+    pending.pop_front();
+    --npending;
+  }
+}
+
+// Check all the objects not checked yet
+static void verify_pending() {
+  while(npending) {
+    check_object(pending.front());
+    pending.pop_front();
+    --npending;
+  }
+}
+
+// Check that every object below PATH has the hash its name says it has
+static void verify_recurse(const string &path,
+                           unsigned long long &objects,
+                           unsigned long long &bytes) {
+  list<DirEntry> files;
+  uint8_t h[HASH_SIZE];
+
+  backupfs->scan(path, files);
+  for(list<DirEntry>::const_iterator it = files.begin();
+      it != files.end();
+      ++it) {
+    const string fullname = path + "/" + it->name;
+
+    switch(it->type) {
+    case RegularFile:
+      try {
+        hashdecode(it->name, h);
+      } catch(...) {
+        warning("%s: not an object", fullname.c_str());
+        break;
+      }
+      verify_object("", fullname, h);
+      ++objects;
+      bytes += it->size;
+      break;
+    case Directory:
+      verify_recurse(fullname, objects, bytes);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+// Verify every object in the repository, whether any index refers to it or not
+void do_verify_all() {
+  unsigned long long objects = 0, bytes = 0;
+
+  if(repo == "") fatal("no repository specified");
+  if(root != "") fatal("root specified for --verify-all");
+  if(indexfile != "") fatal("--index is not compatible with --verify-all");
+  verify_recurse(repo + "/" + HASH_NAME, objects, bytes);
+  verify_pending();
+  if(verbose)
+    fprintf(stderr, "verified %llu objects (%llu bytes)\n", objects, bytes);
+}
+
 void do_verify() {
   if(repo == "") fatal("no repository specified");
   if(root != "") fatal("root specified for --verify");
   if(indexfile == "") fatal("no index specified");
-  File *f = backupfs->open(indexfile, ReadOnly);
+  File *f = openindex(backupfs, indexfile);
   map<string,string> details;
+  string hp;
   while(readIndexLine(f, details)) {
     const string &name = details["name"];
     const string *type = getdetail(details, "type");
@@ -35,26 +151,16 @@ void do_verify() {
       if(getdetail(details, "data"))
         ;                               // ok
       else if(const string *hash = getdetail(details, HASH_NAME)) {
-        uint8_t h[HASH_SIZE], actual_hash[HASH_SIZE];
+        uint8_t h[HASH_SIZE];
         hashdecode(*hash, h);
-        const string hp = repo + "/" + HASH_NAME + "/" + hashpath(h);
-        try {
-          hashfile(backupfs, hp, actual_hash);
-          if(memcmp(h, actual_hash, HASH_SIZE)) {
-            error("%s: hash mismatch for %s", name.c_str(), hp.c_str());
-            if(detectbogus)
-              backupfs->remove(hp);
-          }
-        } catch(FileError &e) {
-          if(e.error() != ENOENT)
-            throw;
-          error("%s: cannot find %s", name.c_str(), hp.c_str());
-        }
+        objectpath(hp, h);
+        verify_object(name, hp, h);
       } else
         error("%s: no known hash", name.c_str());
     }
   }
   delete f;
+  verify_pending();
 }
 
 /*
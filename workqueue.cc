@@ -0,0 +1,153 @@
+/*
+ * This file is part of hbackup.
+ * Copyright (C) 2009 Richard Kettlewell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+#include "nhbackup.h"
+
+// Work Queues ----------------------------------------------------------------
+
+WorkItem::~WorkItem() {}
+
+WorkQueue::WorkQueue(size_t maxlength_): length(0), maxlength(maxlength_),
+                                         busy(0), finished(false) {
+  pthread_mutex_init(&mutex, 0);
+  pthread_cond_init(&cond, 0);
+}
+
+WorkQueue::~WorkQueue() {
+  for(list<WorkItem *>::iterator it = items.begin(); it != items.end(); ++it)
+    delete *it;
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+void WorkQueue::done(Filesystem */*fs*/) {
+}
+
+void *WorkQueue::thread(void *arg) {
+  Worker *const w = (Worker *)arg;
+  WorkQueue *const q = w->q;
+
+  q->lock();
+  for(;;) {
+    while(!q->length && !q->finished)
+      pthread_cond_wait(&q->cond, &q->mutex);
+    if(!q->length)
+      break;
+    WorkItem *const item = q->items.front();
+    q->items.pop_front();
+    --q->length;
+    pthread_cond_broadcast(&q->cond);
+    // After a failure just discard everything
+    if(q->failure.size()) {
+      delete item;
+      continue;
+    }
+    ++q->busy;
+    q->unlock();
+    string failure;
+    try {
+      item->run(w->fs);
+    } catch(exception &e) {
+      failure = e.what();
+    }
+    delete item;
+    q->lock();
+    --q->busy;
+    if(failure.size() && q->failure.empty())
+      q->failure = failure;
+    pthread_cond_broadcast(&q->cond);
+  }
+  q->unlock();
+  try {
+    q->done(w->fs);
+  } catch(exception &e) {
+    q->lock();
+    if(q->failure.empty())
+      q->failure = e.what();
+    q->unlock();
+  }
+  return 0;
+}
+
+void WorkQueue::start(const vector<Filesystem *> &fss) {
+  // Workers are never added after this, so their addresses are stable
+  workers.resize(fss.size());
+  for(size_t n = 0; n < fss.size(); ++n) {
+    int rc;
+    workers[n].q = this;
+    workers[n].fs = fss[n];
+    if((rc = pthread_create(&workers[n].id, 0, thread, &workers[n])))
+      fatal("pthread_create: %s", strerror(rc));
+  }
+}
+
+// Report the first failure from the threads, if there was one.  Called with
+// the queue locked.
+void WorkQueue::check() {
+  if(failure.size()) {
+    const string f = failure;
+    unlock();
+    fatal("%s", f.c_str());
+  }
+}
+
+void WorkQueue::add(WorkItem *w) {
+  lock();
+  while(length >= maxlength && failure.empty())
+    pthread_cond_wait(&cond, &mutex);
+  if(failure.size()) {
+    delete w;
+    check();
+  }
+  items.push_back(w);
+  ++length;
+  pthread_cond_broadcast(&cond);
+  unlock();
+}
+
+void WorkQueue::wait() {
+  lock();
+  while((length || busy) && failure.empty())
+    pthread_cond_wait(&cond, &mutex);
+  check();
+  unlock();
+}
+
+void WorkQueue::finish() {
+  if(workers.empty())
+    return;
+  lock();
+  finished = true;
+  pthread_cond_broadcast(&cond);
+  unlock();
+  for(size_t n = 0; n < workers.size(); ++n)
+    pthread_join(workers[n].id, 0);
+  workers.clear();
+  if(failure.size())
+    fatal("%s", failure.c_str());
+}
+
+/*
+Local Variables:
+c-basic-offset:2
+comment-column:40
+fill-column:79
+indent-tabs-mode:nil
+End:
+*/